@@ -0,0 +1,50 @@
+#pragma once
+#include <memory>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+
+// Largest squared distance of two BGR colors
+const int MAX_COLOR_SSD = 3 * 255 * 255;
+
+// Squared distance of two colors (整数で計算するので飽和しない)
+inline int color_ssd(const cv::Vec3b& a, const cv::Vec3b& b) {
+  int d0 = a[0] - b[0];
+  int d1 = a[1] - b[1];
+  int d2 = a[2] - b[2];
+  return d0 * d0 + d1 * d1 + d2 * d2;
+}
+
+// Sum of the absolute differences of two colors
+inline int color_sad(const cv::Vec3b& a, const cv::Vec3b& b) {
+  return abs(a[0] - b[0]) + abs(a[1] - b[1]) + abs(a[2] - b[2]);
+}
+
+/*
+Weights exp(-sqrt(ssd) / 2 / sigma^2) of every squared distance
+(pwasの色の重み)．表の値はexpを直接計算した場合と同じ
+*/
+class ColorWeightLut {
+  vector<double> table;
+
+ public:
+  ColorWeightLut(double sigma);
+
+  /*
+  Table of sigma kept across calls (thread safe)
+  表は約1.5MBあり作るのも重いので，Tunerのように同じsigmaで
+  繰り返し呼ぶ場合に使い回す
+  */
+  static shared_ptr<const ColorWeightLut> shared(double sigma);
+
+  double operator[](int ssd) const { return table[ssd]; }
+};
+
+/*
+Squared distances between center and colors[samples[n]] (n < cnt)
+タップの色を集めてからCV_SIMD128で4タップずつ計算する
+*/
+void color_ssd_taps(const cv::Vec3b& center, const cv::Vec3b* colors,
+                    const int* samples, int cnt, int* ssd);
@@ -0,0 +1,110 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+
+/*
+Binary frame cache
+PCD/PNGのデコードを省略するために，カメラ座標系に変換済みの点群と画像の
+生データを1フレーム1ファイルで保存する
+*/
+struct FrameCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t point_cnt;
+  int32_t img_rows;
+  int32_t img_cols;
+  int32_t img_type;
+  // Rings of the points after the image (0 if the cloud has no ring field)
+  uint32_t ring_cnt;
+  int64_t pcd_mtime;
+  int64_t png_mtime;
+  uint64_t points_offset;
+  uint64_t img_offset;
+};
+
+// Read-only memory mapped cache file
+class MappedFrame {
+  void* data;
+  size_t length;
+
+ public:
+  MappedFrame();
+  MappedFrame(MappedFrame&& other);
+  MappedFrame& operator=(MappedFrame&& other);
+  MappedFrame(const MappedFrame&) = delete;
+  MappedFrame& operator=(const MappedFrame&) = delete;
+  ~MappedFrame();
+
+  bool open(const string& path);
+  void close();
+  bool is_open() const;
+
+  const FrameCacheHeader& header() const;
+
+  // Points in the pcl::PointXYZ memory layout
+  const pcl::PointXYZ* points() const;
+
+  // Image which refers the mapped memory (valid while this is open)
+  cv::Mat image() const;
+
+  // Ring of each point (nullptr if the cloud has no ring field)
+  const uint16_t* rings() const;
+
+  void copy_cloud(pcl::PointCloud<pcl::PointXYZ>& cloud) const;
+  void copy_rings(vector<uint16_t>& rings) const;
+};
+
+/*
+Serialize the frame in the cache file format
+ソケットでフレームを送る場合にも同じ形式を使う
+*/
+void encode_frame(const pcl::PointCloud<pcl::PointXYZ>& cloud,
+                  const cv::Mat& img, vector<char>& buffer,
+                  int64_t pcd_mtime = 0, int64_t png_mtime = 0,
+                  const vector<uint16_t>* rings = nullptr);
+
+// Deserialize the frame. Returns false if the data is broken
+bool decode_frame(const char* data, size_t length, cv::Mat& img,
+                  pcl::PointCloud<pcl::PointXYZ>& cloud,
+                  vector<uint16_t>* rings = nullptr);
+
+bool write_frame_cache(const string& path,
+                       const pcl::PointCloud<pcl::PointXYZ>& cloud,
+                       const cv::Mat& img, int64_t pcd_mtime,
+                       int64_t png_mtime,
+                       const vector<uint16_t>* rings = nullptr);
+
+/*
+Load <name>.png and <name>.pcd in the data folder
+点群はカメラ座標系に変換される
+cache_folder_pathが空でなければキャッシュを使用・更新する
+ringsには点ごとのリング番号を返す(ringフィールドがなければ空)
+*/
+bool load_frame(const string& data_folder_path, const string& name,
+                const string& cache_folder_path, cv::Mat& img,
+                pcl::PointCloud<pcl::PointXYZ>& cloud, vector<uint16_t>& rings);
+bool load_frame(const string& data_folder_path, const string& name,
+                const string& cache_folder_path, cv::Mat& img,
+                pcl::PointCloud<pcl::PointXYZ>& cloud);
+
+/*
+Map the cache of the frame, creating it from PCD/PNG when it is missing
+or older than the sources
+*/
+bool map_frame(const string& data_folder_path, const string& name,
+               const string& cache_folder_path, MappedFrame& frame);
+
+/*
+Load a PCD of pcl::PointXYZ, pcl::PointXYZI, or points with the ring field
+(e.g. PointXYZIR of the Velodyne driver)
+点群はカメラ座標系に変換し，リングは点の順に返す(ringフィールドがなければ空)
+*/
+bool load_cloud(const string& pcd_path, pcl::PointCloud<pcl::PointXYZ>& cloud,
+                vector<uint16_t>& rings);
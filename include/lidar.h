@@ -0,0 +1,60 @@
+#pragma once
+#include <string>
+#include <vector>
+
+#include "models.h"
+
+using namespace std;
+
+/*
+Vertical beam layout of a LiDAR
+レイヤーはカメラ座標系でのatan2(y, r)の昇順(0が最も上向きのビーム)
+リングはセンサーのレーザー番号で，レイヤーとの対応は表で引く
+*/
+class LidarModel {
+  string model_name;
+  // atan2(y, r) of each layer [rad]
+  vector<double> layer_rads;
+  // Boundaries between adjacent layers (midpoints) and the outer limits
+  vector<double> bounds;
+  vector<int> ring_layers;
+
+  // 等間隔のモデルは従来の式でレイヤーを求める
+  bool is_uniform;
+  double min_rad;
+  double delta_rad;
+
+ public:
+  LidarModel();
+
+  /*
+  Evenly spaced beams between min_angle_degree and max_angle_degree of
+  atan2(y, r) (the old hard-coded model)
+  ring_ascendingならリング0が最も下向き(Velodyne)，そうでなければ最も上向き(Ouster)
+  */
+  static LidarModel uniform(const string& name, int layer_cnt,
+                            double min_angle_degree, double max_angle_degree,
+                            bool ring_ascending = true);
+
+  // Elevation angle (upward positive) of each ring from the datasheet [deg]
+  static LidarModel from_elevations(const string& name,
+                                    const vector<double>& elevation_degrees);
+
+  const string& name() const;
+  int layer_cnt() const;
+  int ring_cnt() const;
+
+  // atan2(y, r) of the layer [rad]
+  double layer_rad(int layer) const;
+
+  // Layer of the direction (-1 if out of the field of view)
+  int layer_of(double y, double r) const;
+
+  // Layer of the ring index (-1 if unknown)
+  int layer_of_ring(int ring) const {
+    return ring < 0 || ring >= ring_layers.size() ? -1 : ring_layers[ring];
+  }
+};
+
+// LiDAR of the profile (the default is 64 layers evenly spaced in ±16.6 deg)
+const LidarModel& lidar_model(const EnvParams& env_params);
@@ -1,4 +1,8 @@
 #pragma once
+#include <functional>
+#include <string>
+#include <vector>
+
 #include <opencv2/opencv.hpp>
 
 #include "models.h"
@@ -11,15 +15,134 @@ void linear(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
 void ip_basic(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
               EnvParams env_params);
 
+// ip_basic by cv::dilate and cv::morphologyEx (reference implementation)
+void ip_basic_opencv(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+                     EnvParams env_params);
+
 void mrf(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
          EnvParams env_params, cv::Mat img, double k, double c);
 
+/*
+mrf starting from initial_grid (e.g. the result of the previous frame)
+initial_grid <= 0の点は線形補間の値を初期値とする
+*/
+void mrf(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+         EnvParams env_params, cv::Mat img, double k, double c,
+         const cv::Mat& initial_grid);
+
+/*
+mrf solved in the bilateral space (fast bilateral solver)
+グリッドを(x, y, 輝度)の格子にトライリニアでスプラットし，格子の頂点で平滑化項と
+データ項(重みはmrfと同じk^2)の小さな連立方程式を解いてスライスする
+sigma_s: 格子の間隔 [グリッドの画素], sigma_l: 輝度の間隔
+*/
+void bilateral_solver(const cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+                      cv::Mat& img, double k, double sigma_s, double sigma_l);
+
 void guided_filter(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
                    EnvParams env_params, cv::Mat img);
 
+/*
+Valid samples in the window of each grid point (CSR)
+窓内でsrc_grid > 0の点のみを保持し，フレームごとに一度だけ構築する
+*/
+struct NeighborIndex {
+  // Offsets of the window
+  vector<cv::Point> window;
+  // Samples of (y, x) are in [offsets[y * cols + x], offsets[y * cols + x + 1])
+  vector<int> offsets;
+  // Index in the window
+  vector<int> taps;
+  // y * cols + x of the sample
+  vector<int> samples;
+
+  size_t bytes() const;
+};
+
+// Window of pwas (r / 2 is not rounded as in the original loop)
+vector<cv::Point> pwas_window(double r);
+
+// Window of the original method
+vector<cv::Point> ext_jbu_window(int r);
+
+void build_neighbor_index(const cv::Mat& src_grid,
+                          const vector<cv::Point>& window,
+                          NeighborIndex& neighbors);
+
 void pwas(const cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs, cv::Mat& img,
           double sigma_c, double sigma_s, double sigma_r, double r);
 
+void pwas(const cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs, cv::Mat& img,
+          double sigma_c, double sigma_s, double sigma_r,
+          const NeighborIndex& neighbors);
+
+struct PwasParams {
+  double sigma_c;
+  double sigma_s;
+  double sigma_r;
+};
+
+/*
+pwas for many parameters in one traversal of the neighborhoods
+近傍の色・距離・有効な点は共通で，重みのみパラメータごとに計算する
+dst_grids[k]はpwas(src_grid, dst_grid, vs, img, params[k]..., r)と同じ
+*/
+void pwas_batch(const cv::Mat& src_grid, vector<cv::Mat>& dst_grids,
+                cv::Mat& vs, cv::Mat& img, const vector<PwasParams>& params,
+                double r);
+
+void pwas_batch(const cv::Mat& src_grid, vector<cv::Mat>& dst_grids,
+                cv::Mat& vs, cv::Mat& img, const vector<PwasParams>& params,
+                const NeighborIndex& neighbors);
+
+/*
+Edge-aware normalized convolution by the domain transform (recursive filter)
+グリッドの色で横・縦の1次元フィルタを交互にかける．計算量はsigma_sによらず画素数に比例する
+*/
+void domain_transform(const cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+                      cv::Mat& img, double sigma_s, double sigma_r,
+                      int iterations);
+
+void original(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+              EnvParams& env_params, cv::Mat& img, double color_segment_k,
+              double sigma_s, int r, double coef_s);
+
 void original(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
               EnvParams& env_params, cv::Mat& img, double color_segment_k,
-              double sigma_s, int r, double coef_s);
\ No newline at end of file
+              double sigma_s, const NeighborIndex& neighbors, double coef_s);
+
+// Color segment of each pixel of the image (CV_32SC1)
+void segment_labels(cv::Mat& img, double color_segment_k, cv::Mat& labels);
+
+/*
+Joint bilateral upsampling of the original method with precomputed segments
+labelsは画像と同じ大きさで，同じ値の画素が同じ領域となる
+*/
+void ext_jbu(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+             const cv::Mat& labels, double sigma_s,
+             const NeighborIndex& neighbors, double coef_s);
+
+/*
+Coarse-to-fine interpolation on a pyramid of the grid
+有効な点の平均で粗いグリッドを作り，最も粗いレベルの穴をdomain_transformで埋めてから，
+粗いレベルの結果を3x3の同時バイラテラル重みで細かいレベルの穴に戻す．
+大きな穴も1画素あたり一定の計算量で埋まる
+*/
+void pyramid(const cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+             cv::Mat& img, double sigma_s, double sigma_r,
+             int max_levels = 6);
+
+/*
+Interpolation method called by name
+imgは補正・平滑化済みの案内画像
+*/
+typedef function<void(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+                      EnvParams& env_params, cv::Mat& img,
+                      HyperParams& hyper_params)>
+    InterpolationMethod;
+
+// Names of the registered methods in the order of registration
+vector<string> method_names();
+
+// Returns nullptr for an unknown name
+const InterpolationMethod* find_method(const string& name);
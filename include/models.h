@@ -1,7 +1,15 @@
 #pragma once
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
 
 using namespace std;
 
+class LidarModel;
+
 struct EnvParams {
   int width;
   int height;
@@ -14,23 +22,95 @@ struct EnvParams {
   int yaw;
 
   bool isFullHeight;
+
+  /*
+  Pinhole model of the undistorted image [px]
+  プロファイルで指定しない場合はfx = fy = f_xy，主点は画像の中心(整数に切り捨て)
+  */
+  double fx;
+  double fy;
+  double cx;
+  double cy;
+  // Distortion coefficients (k1, k2, p1, p2, k3) of the raw image
+  double distortion[5];
+
+  // Beam layout of the LiDAR (nullptr: 64 layers evenly spaced in ±16.6 deg)
+  shared_ptr<const LidarModel> lidar;
+  // Layers kept in the input of the interpolation
+  int down_layer_cnt;
 };
 
+// True if the raw image has to be undistorted
+bool has_distortion(const EnvParams& env_params);
+
 struct HyperParams {
   double mrf_k;
   double mrf_c;
+  // Bilateral solver (the data weight is mrf_k)
+  double bs_sigma_s;
+  double bs_sigma_l;
 
   double pwas_sigma_c;
   double pwas_sigma_s;
   double pwas_sigma_r;
   int pwas_r;
 
+  double dt_sigma_s;
+  double dt_sigma_r;
+  int dt_iterations;
+
   double original_color_segment_k;
   double original_sigma_s;
   int original_r;
   double original_coef_s;
+
+  double pyramid_sigma_s;
+  double pyramid_sigma_r;
+};
+
+// LiDAR to camera transformation of the calibration parameters
+Eigen::Matrix4d calibration_matrix(const EnvParams& env_params);
+
+// Calibration setting of a rig
+struct Profile {
+  string name;
+  EnvParams env_params;
+  HyperParams hyper_params;
+};
+
+/*
+Immutable set of the profiles loaded from a config file (YAML or JSON)
+ファイルの形式はconfig/profiles.yamlを参照
+*/
+class ProfileRegistry {
+  map<string, Profile> profiles;
+  map<string, shared_ptr<const LidarModel>> lidars;
+  HyperParams default_hyper_params;
+
+ public:
+  // Throws runtime_error if the file cannot be read or an entry is invalid
+  static shared_ptr<const ProfileRegistry> load(const string& path);
+
+  // Throws out_of_range for an unknown name
+  const Profile& get(const string& name) const;
+  bool contains(const string& name) const;
+  vector<string> names() const;
+  const HyperParams& default_hyper() const;
+
+  // Beam table of the 'lidars' section. Throws out_of_range for an unknown name
+  shared_ptr<const LidarModel> lidar(const string& name) const;
 };
 
+/*
+Profiles of the current config file
+POINT_INTERPOLATION_PROFILESで指定したファイル(なければビルド時の既定のファイル)を読む．
+ファイルが更新されていれば読み直し，失敗した場合はそれまでの内容を使い続ける
+*/
+shared_ptr<const ProfileRegistry> profiles();
+void set_profiles_path(const string& path);
+
+// Throw out_of_range for an unknown name
 EnvParams load_env_params(string params_name);
+HyperParams load_hyper_params(string params_name);
 
-HyperParams load_default_hyper_params();
\ No newline at end of file
+HyperParams load_default_hyper_params();
@@ -0,0 +1,37 @@
+#pragma once
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+
+/*
+Separable morphology on CV_64FC1 grids
+cv::dilate, cv::erodeと同じく画像外の画素は無視する (結果はビット単位で一致)
+dstはsrcと同じMatでもよい
+*/
+
+/*
+Max filter with a kx * ky rectangle (dilation)
+van Herk/Gil-Werman法で窓の大きさによらず1画素あたり定数回の比較で求める
+keepが与えられた場合，keep > 0の画素はkeepの値を残す
+*/
+void max_filter(const cv::Mat& src, cv::Mat& dst, int kx, int ky,
+                const cv::Mat* keep = nullptr);
+
+// Min filter with a kx * ky rectangle (erosion)
+void min_filter(const cv::Mat& src, cv::Mat& dst, int kx, int ky);
+
+// Max filter with the 3 * 3 cross. Applying twice is the diamond of size 5
+void cross_max_filter(const cv::Mat& src, cv::Mat& dst);
+
+/*
+Buffers of ip_basic reused between frames
+フレームごとに確保し直さないよう，呼び出し側で保持する
+*/
+struct IpBasicWorkspace {
+  cv::Mat inverted;
+  cv::Mat dilated;
+  cv::Mat filled;
+};
+
+void ip_basic(const cv::Mat& src_grid, cv::Mat& dst_grid,
+              IpBasicWorkspace& workspace);
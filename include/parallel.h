@@ -0,0 +1,87 @@
+#pragma once
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+
+/*
+Data parallel execution layer
+全てのカーネルはここを通して並列化する．並列実行中に呼ばれた場合は直列に実行するので，
+フレーム単位の並列化と組み合わせてもスレッド数を超えない
+*/
+enum class ParallelBackend { SERIAL, OPENCV, OPENMP, TBB };
+
+// Returns false if the backend is not built in
+bool set_parallel_backend(ParallelBackend backend);
+// "serial", "opencv", "openmp" or "tbb"
+bool set_parallel_backend(const string& name);
+ParallelBackend parallel_backend();
+
+// Number of worker threads. 0 means all cores
+void set_parallel_threads(int threads);
+int parallel_threads();
+
+// True while running inside parallel_for on this thread
+bool in_parallel_region();
+
+/*
+Run parallel_for serially on this thread while alive
+フレーム単位など，呼び出し側で既に並列化している場合に使う
+*/
+class SerialRegion {
+  bool prev;
+
+ public:
+  SerialRegion();
+  ~SerialRegion();
+  SerialRegion(const SerialRegion&) = delete;
+  SerialRegion& operator=(const SerialRegion&) = delete;
+};
+
+// Call body(begin, end) on disjoint sub-ranges covering [begin, end)
+void parallel_for(int begin, int end, const function<void(int, int)>& body);
+
+/*
+Reduce map(begin, end) of the sub-ranges by reduce
+分割はスレッド数によらず一定なので，結果はスレッド数・バックエンドによらない
+*/
+template <typename T, typename Map, typename Reduce>
+T parallel_reduce(int begin, int end, T identity, const Map& map,
+                  const Reduce& reduce, int grain = 1) {
+  if (end <= begin) {
+    return identity;
+  }
+  int chunk_cnt = (end - begin + grain - 1) / grain;
+  vector<T> partials(chunk_cnt, identity);
+  parallel_for(0, chunk_cnt, [&](int chunk_begin, int chunk_end) {
+    for (int c = chunk_begin; c < chunk_end; c++) {
+      int b = begin + c * grain;
+      partials[c] = map(b, min(b + grain, end));
+    }
+  });
+
+  T result = identity;
+  for (int c = 0; c < chunk_cnt; c++) {
+    result = reduce(result, partials[c]);
+  }
+  return result;
+}
+
+// Same as cv::Mat::forEach, split by rows
+template <typename T, typename F>
+void parallel_for_each(cv::Mat& mat, const F& f) {
+  parallel_for(0, mat.rows, [&](int begin, int end) {
+    int position[2];
+    for (int y = begin; y < end; y++) {
+      T* row = mat.ptr<T>(y);
+      position[0] = y;
+      for (int x = 0; x < mat.cols; x++) {
+        position[1] = x;
+        f(row[x], position);
+      }
+    }
+  });
+}
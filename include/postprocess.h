@@ -9,6 +9,32 @@
 
 using namespace std;
 
+/*
+Valid (nonzero) cells of a ground truth grid
+真値は全レイヤーのLiDARが当たったセルにしかないので，評価はこのセルだけを見る
+*/
+struct GroundTruthIndex {
+  int rows = 0;
+  int cols = 0;
+  // Valid cells in the row-major order. Those of row i are
+  // cells[row_offsets[i], row_offsets[i + 1])
+  vector<cv::Point> cells;
+  vector<int> row_offsets;
+
+  // SSIM blocks containing valid cells. Those of block row k are
+  // blocks[block_row_offsets[k], block_row_offsets[k + 1]), and the cells of
+  // block b are block_cells[block_offsets[b], block_offsets[b + 1])
+  int block_size = 0;
+  vector<int> block_row_offsets;
+  vector<int> block_offsets;
+  vector<cv::Point> block_cells;
+
+  size_t bytes() const;
+};
+
+void build_ground_truth_index(cv::Mat& original_grid, int block_size,
+                              GroundTruthIndex& index);
+
 namespace qm {
 // sigma on block_size
 double sigma(cv::Mat& m, int i, int j, int block_size);
@@ -30,12 +56,45 @@ double ssim(cv::Mat& img1, cv::Mat& img2, int block_size);
 
 // Compute the f value between img1 (original) and img2 (reference)
 double f_value(cv::Mat& img1, cv::Mat& img2);
+
+// Same as above, but only on the valid cells of img1
+double mre(cv::Mat& img1, cv::Mat& img2, const GroundTruthIndex& index);
+double eqm(cv::Mat& img1, cv::Mat& img2, const GroundTruthIndex& index);
+double ssim(cv::Mat& img1, cv::Mat& img2, const GroundTruthIndex& index);
+double f_value(cv::Mat& img1, cv::Mat& img2, const GroundTruthIndex& index);
 }  // namespace qm
 
 void evaluate(cv::Mat& grid, cv::Mat& original_grid, EnvParams& env_params,
               double& ssim, double& mse, double& mre, double& f_val);
 
+// Evaluate with the index of original_grid built beforehand
+void evaluate(cv::Mat& grid, cv::Mat& original_grid,
+              const GroundTruthIndex& gt_index, EnvParams& env_params,
+              double& ssim, double& mse, double& mre, double& f_val);
+
 void restore_pointcloud(cv::Mat& grid, cv::Mat& vs, EnvParams env_params,
-                        pcl::PointCloud<pcl::PointXYZ>& dst_cloud);
+                        pcl::PointCloud<pcl::PointXYZ>& dst_cloud,
+                        bool skip_invalid = true);
+
+/*
+Restore point cloud into a caller-provided buffer
+Returns the number of restored points. Nothing is written if it exceeds
+capacity.
+*/
+size_t restore_pointcloud(const cv::Mat& grid, const cv::Mat& vs,
+                          EnvParams& env_params, pcl::PointXYZ* dst,
+                          size_t capacity, bool skip_invalid = true);
+
+// Same as above, but into separated x, y, z arrays (SoA)
+size_t restore_pointcloud(const cv::Mat& grid, const cv::Mat& vs,
+                          EnvParams& env_params, float* xs, float* ys,
+                          float* zs, size_t capacity, bool skip_invalid = true);
+
+void generate_depth_image(cv::Mat &grid, cv::Mat &img);
 
-void generate_depth_image(cv::Mat &grid, cv::Mat &img);
\ No newline at end of file
+/*
+Upsample the layer grid to a dense depth map of the image resolution
+vsに沿って列ごとに縦方向の補間を行う
+*/
+void upsample_dense(const cv::Mat &grid, const cv::Mat &vs,
+                    EnvParams &env_params, cv::Mat &dense, int tile_cols = 64);
\ No newline at end of file
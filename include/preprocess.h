@@ -1,14 +1,22 @@
 #pragma once
+#include <cstdint>
 #include <vector>
 
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
 #include <opencv2/opencv.hpp>
 
+#include "lidar.h"
 #include "models.h"
 
 using namespace std;
 
+/*
+True if the layer is kept when layer_cnt layers are thinned to down_layer_cnt
+割り切れない比(64 -> 24など)でもdown_layer_cnt本のレイヤーをほぼ等間隔に残す
+*/
+bool keep_layer(int layer, int layer_cnt, int down_layer_cnt);
+
 /*
 Downsample point cloud
 */
@@ -17,14 +25,59 @@ void downsample(pcl::PointCloud<pcl::PointXYZ>& src_cloud,
                 double min_angle_degree, double max_angle_degree,
                 int original_layer_cnt, int down_layer_cnt);
 
+/*
+Keep down_layer_cnt layers of the LiDAR (keep_layer)
+ringsが点と同じ数あればレイヤーをリング番号から引く．dst_ringsには残した点のリングを返す
+*/
+void downsample(const pcl::PointCloud<pcl::PointXYZ>& src_cloud,
+                pcl::PointCloud<pcl::PointXYZ>& dst_cloud,
+                const LidarModel& lidar, int down_layer_cnt,
+                const vector<uint16_t>* rings = nullptr,
+                vector<uint16_t>* dst_rings = nullptr);
+
+/*
+How to reduce the points falling into the same cell of the grid
+NEAREST: The nearest point (ties: the earlier point)
+LAST: The last point in the point order
+MEAN: Mean depth (and mean image row) of the points
+COUNT: Number of points, with the image row of the nearest point
+*/
+enum class GridReducer { NEAREST, LAST, MEAN, COUNT };
+
 /*
 Transform point cloud into depth image
 カメラ座標系でLiDARグリッドを構築する
+投影は点ごとに，セルへの集約はレイヤーごとに並列に行う．結果はスレッド数によらない
 */
 void grid_pointcloud(const pcl::PointCloud<pcl::PointXYZ>& src_cloud,
                      double min_angle_degree, double max_angle_degree,
                      int target_layer_cnt, EnvParams& env_params, cv::Mat& grid,
-                     cv::Mat& vs);
+                     cv::Mat& vs, GridReducer reducer = GridReducer::NEAREST);
+
+// One row per layer of the LiDAR (rings: ring of each point, ignored if
+// empty)
+void grid_pointcloud(const pcl::PointCloud<pcl::PointXYZ>& src_cloud,
+                     const LidarModel& lidar, EnvParams& env_params,
+                     cv::Mat& grid, cv::Mat& vs,
+                     GridReducer reducer = GridReducer::NEAREST,
+                     const vector<uint16_t>* rings = nullptr);
+
+/*
+Thin the grid of all layers to down_layer_cnt layers by zeroing rows
+間引いた点群をグリッド化し直す代わりに，全レイヤーのグリッドから各疎さの入力を作る
+消した行のvsはgrid_pointcloudの空のセルと同じ値にする
+*/
+void mask_layers(const cv::Mat& grid, const cv::Mat& vs,
+                 const LidarModel& lidar, EnvParams& env_params,
+                 int down_layer_cnt, cv::Mat& dst_grid, cv::Mat& dst_vs);
 
 void remove_noise(cv::Mat& src, cv::Mat& dst, cv::Mat& vs, EnvParams env_params,
-                  double rad_coef = 0.01, int min_k = 2);
\ No newline at end of file
+                  double rad_coef = 0.01, int min_k = 2);
+
+/*
+Undistort the raw image by the distortion of the camera
+補正後の画像はfx, fy, cx, cyのピンホールモデルに従う．変換表はカメラごとに1度だけ作る
+歪みがなければsrcをそのまま返す
+*/
+void undistort_image(const cv::Mat& src, cv::Mat& dst,
+                     const EnvParams& env_params);
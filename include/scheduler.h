@@ -0,0 +1,73 @@
+#pragma once
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "service.h"
+
+using namespace std;
+
+/*
+FRAMES: Run frames concurrently, one worker per core, with serial kernels
+INTRA: Run frames one by one, with all cores in each kernel
+AUTO: Measure both on the first frames and choose the faster one
+*/
+enum class ScheduleMode { FRAMES, INTRA, AUTO };
+
+// "frames", "intra" or "auto"
+bool parse_schedule_mode(const string& name, ScheduleMode& mode);
+string schedule_mode_name(ScheduleMode mode);
+
+struct NumaNode {
+  int id;
+  // CPUs of the node available to this process
+  vector<int> cpus;
+};
+
+/*
+NUMA nodes of the machine (/sys/devices/system/node)
+取得できない場合は全てのCPUを含む1ノードを返す
+*/
+vector<NumaNode> numa_nodes();
+
+// Restrict the calling thread to the CPUs
+bool pin_current_thread(const vector<int>& cpus);
+
+struct ScheduleStats {
+  ScheduleMode mode;
+  // Frames processed at the same time, and threads of each frame
+  int workers;
+  int threads;
+  double wall_ms;
+  // Frames per second
+  double throughput;
+  // Measured time of a frame in AUTO mode [ms] (0 if not measured)
+  double intra_ms;
+  double serial_ms;
+  // Processing time of each frame [ms]
+  LatencyHistogram latency;
+
+  void print(ostream& os) const;
+};
+
+/*
+Scheduler of the frames of a batch run
+FRAMESではワーカーをNUMAノードに均等に割り当てて固定する．フレームのバッファは
+ワーカー上で確保・初期化されるので(first touch)同じノードのメモリに置かれる
+*/
+class FrameScheduler {
+  ScheduleMode mode;
+  // Upper limit of the latency of a frame in AUTO mode [ms] (0: no limit)
+  double max_latency_ms;
+
+ public:
+  FrameScheduler(ScheduleMode mode = ScheduleMode::AUTO,
+                 double max_latency_ms = 0);
+
+  /*
+  Call job(i) once for each frame i in [0, frame_cnt)
+  ワーカー数はparallel_threads()．INTRAでは呼び出したスレッドで順に実行する
+  */
+  ScheduleStats run(int frame_cnt, const function<void(int)>& job);
+};
@@ -0,0 +1,154 @@
+#pragma once
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "models.h"
+
+using namespace std;
+
+// A hyper parameter to be tuned, and its grid
+struct SearchDimension {
+  string name;
+  double min_val;
+  double max_val;
+  double step;
+  function<void(HyperParams&, double)> set;
+
+  vector<double> grid() const;
+};
+
+// Search space of the method. Empty if the method has no hyper parameter
+vector<SearchDimension> search_space(string method_name);
+
+// Error of the parameters on a frame. Must be non-negative
+typedef function<double(const HyperParams& params, int frame_idx)> Objective;
+
+/*
+Errors of many parameters on a frame
+まとめて計算できる手法(pwas)で使用する
+*/
+typedef function<vector<double>(const vector<HyperParams>& params,
+                                int frame_idx)>
+    BatchObjective;
+
+struct SearchResult {
+  HyperParams params;
+  vector<double> values;
+  double error;
+  // Number of evaluations on a single frame
+  int evaluations;
+  // Number of evaluations skipped by early termination
+  int pruned_evaluations;
+};
+
+// Called whenever the best parameters are updated
+typedef function<void(const SearchResult& result)> SearchCallback;
+
+class SearchStrategy {
+ protected:
+  vector<SearchDimension> space;
+  HyperParams base_params;
+  Objective objective;
+  BatchObjective batch_objective;
+  int batch_size;
+  int frame_cnt;
+  SearchCallback on_update;
+
+  bool pruning;
+
+  SearchResult best;
+  // Error on each frame (negative if not evaluated yet)
+  map<vector<double>, vector<double>> memo;
+  // Sum of errors on each frame, to evaluate hard frames first
+  vector<double> frame_error_sums;
+  vector<int> frame_error_cnts;
+
+  /*
+  Mean error of the values on the first frame_cnt frames
+  誤差は非負なので，途中で平均がboundを超えた時点で打ち切り，
+  その時点の値(boundより大きい下界)を返す
+  */
+  double evaluate(const vector<double>& values, int frame_cnt,
+                  double bound = 1e18);
+  // Evaluate the values on all frames and update the best
+  double evaluate_full(const vector<double>& values);
+  // Same as evaluate_full for each candidate, in batches if possible
+  void evaluate_full(const vector<vector<double>>& candidates);
+
+  HyperParams to_params(const vector<double>& values) const;
+
+  virtual void run() = 0;
+
+ public:
+  SearchStrategy();
+  virtual ~SearchStrategy() {}
+
+  // Enable early termination of the candidates which can't beat the best
+  void set_pruning(bool pruning);
+
+  // Evaluate up to batch_size candidates at once with batch_objective
+  void set_batch_objective(const BatchObjective& batch_objective,
+                           int batch_size);
+
+  SearchResult search(const vector<SearchDimension>& space,
+                      const HyperParams& base_params,
+                      const Objective& objective, int frame_cnt,
+                      const SearchCallback& on_update = nullptr);
+};
+
+// Exhaustive search on the grid
+class GridSearch : public SearchStrategy {
+ protected:
+  void run() override;
+};
+
+// Uniform sampling on the grid
+class RandomSearch : public SearchStrategy {
+  int trials;
+  unsigned int seed;
+
+ protected:
+  void run() override;
+
+ public:
+  RandomSearch(int trials, unsigned int seed = 0);
+};
+
+// Search on a coarse grid, then narrow the range around the best
+class CoarseToFineSearch : public SearchStrategy {
+  int points_per_dim;
+
+ protected:
+  void run() override;
+
+ public:
+  CoarseToFineSearch(int points_per_dim = 3);
+};
+
+/*
+Successive halving
+候補を少ないフレームで評価し，上位1/etaのみをeta倍のフレームで評価し直す
+*/
+class SuccessiveHalving : public SearchStrategy {
+  int candidates;
+  int min_frames;
+  int eta;
+  unsigned int seed;
+
+ protected:
+  void run() override;
+
+ public:
+  SuccessiveHalving(int candidates, int min_frames = 1, int eta = 3,
+                    unsigned int seed = 0);
+};
+
+/*
+Create the strategy by name
+"grid", "random", "coarse-to-fine" or "halving". nullptr for unknown names
+*/
+shared_ptr<SearchStrategy> make_search_strategy(string strategy_name,
+                                                int trials);
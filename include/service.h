@@ -0,0 +1,127 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+
+// Latency histogram with log-spaced buckets [ms]
+class LatencyHistogram {
+  // Upper bounds of the buckets. The last bucket has no upper bound
+  vector<double> bounds;
+  vector<long long> counts;
+  long long total_cnt;
+  double sum;
+  double max_val;
+
+ public:
+  LatencyHistogram();
+
+  void record(double ms);
+
+  long long count() const;
+  double mean() const;
+  double max() const;
+
+  // Upper bound of the bucket containing the p-quantile (0 <= p <= 1)
+  double percentile(double p) const;
+
+  // Cumulative counts of the buckets, one "le=<bound> <count>" per line
+  void print(ostream& os, const string& label) const;
+};
+
+struct ServiceConfig {
+  // Methods from the best to the cheapest
+  vector<string> methods = {"original", "linear"};
+  // Deadline from the capture of the frame [ms]
+  double deadline_ms = 100;
+  // Weight of the latest latency in the expected latency of a method
+  double smoothing = 0.2;
+  // Run a skipped method again after this many frames to measure it again
+  // (0 to never)
+  int probe_interval = 100;
+};
+
+struct ServiceResult {
+  string name;
+  string method;
+  // A cheaper method was used to meet the deadline
+  bool fallback;
+  bool deadline_missed;
+  // From the capture to the end of the interpolation [ms]
+  double latency_ms;
+  cv::Mat grid;
+};
+
+// Interpolate the frame by the method into grid
+typedef function<void(const string& method,
+                      pcl::PointCloud<pcl::PointXYZ>& cloud, cv::Mat& img,
+                      cv::Mat& grid)>
+    FrameProcessor;
+
+/*
+Interpolation with a per-frame deadline
+各手法の処理時間を移動平均で予測し，残り時間に収まる最良の手法を選ぶ
+*/
+class InterpolationService {
+  ServiceConfig config;
+  FrameProcessor processor;
+
+  // Expected latency of each method (negative if unknown)
+  vector<double> expected_ms;
+  // Frame on which each method ran last
+  vector<long long> last_frames;
+  long long frame_cnt;
+  LatencyHistogram total_histogram;
+  map<string, LatencyHistogram> method_histograms;
+  long long fallback_cnt;
+  long long missed_cnt;
+
+ public:
+  InterpolationService(const ServiceConfig& config,
+                       const FrameProcessor& processor);
+
+  /*
+  Best method expected to finish in remaining_ms. The cheapest if none
+  probe_interval以上使っていない手法は，予測によらず選んで測り直す
+  */
+  int choose_method(double remaining_ms) const;
+
+  // elapsed_ms: Time from the capture to now (transport and queueing)
+  ServiceResult process(const string& name,
+                        pcl::PointCloud<pcl::PointXYZ>& cloud, cv::Mat& img,
+                        double elapsed_ms = 0);
+
+  const LatencyHistogram& latency() const;
+
+  void print_stats(ostream& os) const;
+};
+
+// Monotonic clock shared by the processes on the machine [ns]
+int64_t monotonic_ns();
+
+/*
+Unix domain socket transport
+フレームはキャッシュファイルと同じ形式(encode_frame)で送る．リングは省略できる
+Returns the file descriptor, or -1 on failure
+*/
+int listen_unix_socket(const string& path);
+int connect_unix_socket(const string& path);
+
+bool send_frame(int fd, const string& name, int64_t captured_ns,
+                const pcl::PointCloud<pcl::PointXYZ>& cloud,
+                const cv::Mat& img, const vector<uint16_t>* rings = nullptr);
+bool receive_frame(int fd, string& name, int64_t& captured_ns, cv::Mat& img,
+                   pcl::PointCloud<pcl::PointXYZ>& cloud,
+                   vector<uint16_t>* rings = nullptr);
+
+// Send the result without the grid
+bool send_result(int fd, const ServiceResult& result);
+bool receive_result(int fd, ServiceResult& result);
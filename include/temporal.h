@@ -0,0 +1,123 @@
+#pragma once
+#include <functional>
+#include <memory>
+
+#include <Eigen/Core>
+#include <opencv2/opencv.hpp>
+
+#include "lidar.h"
+#include "models.h"
+
+using namespace std;
+
+/*
+Tiles with at least min_cells changed cells (CV_8UC1, 1 if changed)
+いずれかのチャンネルの差がthresholdを超えるセル，1チャンネルの場合は
+値の有無(0かどうか)が変わったセルも変化とする．大きさが異なる場合は全て変化とする
+*/
+cv::Mat changed_tiles(const cv::Mat& prev, const cv::Mat& now, cv::Size tile,
+                      double threshold, int min_cells = 1);
+
+/*
+Move the grid of the previous frame into the current camera coordinates
+motionは前フレームのカメラ座標から現フレームのカメラ座標への変換
+複数の点が同じセルに入る場合は近い方を残す
+*/
+void warp_grid(const cv::Mat& grid, const cv::Mat& vs, EnvParams& env_params,
+               const Eigen::Matrix4d& motion, double min_angle_degree,
+               double max_angle_degree, cv::Mat& warped);
+void warp_grid(const cv::Mat& grid, const cv::Mat& vs, EnvParams& env_params,
+               const Eigen::Matrix4d& motion, const LidarModel& lidar,
+               cv::Mat& warped);
+
+/*
+Update the color segments of the changed tiles only
+変化したタイルのみをタイルごとに分割し直し，新しいラベルを割り当てる
+変化したタイルの面積がmax_ratioを超える場合は画像全体を分割し直す
+Returns false if the whole image was segmented again
+*/
+bool update_segment_labels(cv::Mat& img, const cv::Mat& changed, cv::Size tile,
+                           double color_segment_k, double max_ratio,
+                           cv::Mat& labels, int& next_label);
+
+// Parameters of the change detection
+struct TileParams {
+  // Tile size on the grid
+  cv::Size tile = cv::Size(64, 16);
+  // Tile height on the image (width is same as the grid)
+  int image_tile_height = 64;
+  // Absolute difference of a cell regarded as a change [m], [intensity]
+  double depth_threshold = 0.1;
+  double color_threshold = 4;
+  // Number of changed cells that make a tile dirty
+  int min_changed_cells = 1;
+  // Recompute the whole grid if the ratio of changed tiles exceeds it
+  double max_dirty_ratio = 0.5;
+  // Segment the whole image again if the changed area exceeds it (original)
+  double max_segment_ratio = 0.3;
+};
+
+/*
+Stateful wrapper of an image guided filter
+最後に計算した時からグリッドか画像が変化したタイルと，
+その変化をhalo内に含むタイルのみを周囲halo分を含めて計算し直す
+*/
+class DirtyTileFilter {
+ public:
+  /*
+  The filter on a crop of the grid
+  imgは画像全体で，colsが切り出した列の範囲 (vsは画像の行を指すので行は切り出さない)
+  */
+  typedef function<void(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+                        cv::Mat& img, cv::Range cols)>
+      TileMethod;
+
+  // Called with the whole image before the tiles. changed is empty on the
+  // first call. Returns false if every tile has to be recomputed
+  typedef function<bool(cv::Mat& img, const cv::Mat& changed,
+                        cv::Size image_tile)>
+      ImageHook;
+
+ private:
+  TileMethod method;
+  int halo;
+  TileParams params;
+  ImageHook on_image;
+
+  bool has_prev;
+  // Inputs from which each tile was last computed. Updated only for the
+  // recomputed tiles
+  cv::Mat ref_src_grid;
+  cv::Mat ref_img;
+  cv::Mat prev_dst_grid;
+  int recomputed;
+
+ public:
+  DirtyTileFilter(TileMethod method, int halo,
+                  TileParams params = TileParams(),
+                  ImageHook on_image = nullptr);
+
+  // Recompute everything on the next call
+  void reset();
+
+  void operator()(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+                  cv::Mat& img);
+
+  // Number of tiles recomputed on the last call
+  int recomputed_tiles() const;
+};
+
+shared_ptr<DirtyTileFilter> pwas_tile_filter(double sigma_c, double sigma_s,
+                                             double sigma_r, double r,
+                                             TileParams params = TileParams());
+
+shared_ptr<DirtyTileFilter> guided_filter_tile_filter(
+    EnvParams env_params, TileParams params = TileParams());
+
+/*
+ext_jbu with the color segments kept between calls
+画像の変化した部分のみ領域分割し直す (update_segment_labels)
+*/
+shared_ptr<DirtyTileFilter> original_tile_filter(
+    double color_segment_k, double sigma_s, int r, double coef_s,
+    TileParams params = TileParams());
@@ -1,12 +1,20 @@
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
 
+#include <Eigen/LU>
 #include <dirent.h>
 #include <pcl/io/pcd_io.h>
 #include <pcl/point_cloud.h>
 #include <opencv2/opencv.hpp>
 
+#include "frame_cache.h"
 #include "interpolate.cpp"
 #include "models.h"
+#include "parallel.h"
+#include "scheduler.h"
 
 using namespace std;
 
@@ -33,59 +41,247 @@ int main(int argc, char* argv[]) {
   }
 
   string params_name = argv[2];
-  EnvParams params_use = load_env_params(params_name);
-  HyperParams hyper_params = load_default_hyper_params();
+  EnvParams params_use;
+  HyperParams hyper_params;
+  try {
+    params_use = load_env_params(params_name);
+    hyper_params = load_hyper_params(params_name);
+  } catch (const exception& e) {
+    cout << e.what() << endl;
+    return 1;
+  }
 
   string method_name = argv[3];
+  if (find_method(method_name) == nullptr) {
+    cout << "Unknown interpolation method name: " << method_name << endl;
+    return 1;
+  }
 
-  for (auto it = file_names.begin(); it != file_names.end(); it++) {
-    string str = *it;
+  // 画像解像度の深度マップの出力先 (--dense <folder>)
+  // フレームキャッシュの保存先 (--cache <folder>)
+  // 前フレームの結果を再利用する (--temporal)
+  // 各フレームのカメラ姿勢 (--poses <file>)
+  // 同じ点群を補完する別のカメラ (--view <calibration setting name> <folder>)
+  // 並列実行のバックエンド (--backend serial|opencv|openmp|tbb)
+  // ワーカースレッド数 (--threads <N>, 0は全コア)
+  // フレーム単位/フレーム内の並列化 (--schedule frames|intra|auto)
+  // autoで許容する1フレームの処理時間 (--max-latency <ms>)
+  // 入力に残すレイヤー数 (--layers <N>, 省略時はプロファイルの値)
+  string dense_folder_path = "";
+  string cache_folder_path = "";
+  string poses_path = "";
+  bool temporal = false;
+  string schedule_name = "";
+  ScheduleMode schedule_mode = ScheduleMode::INTRA;
+  double max_latency_ms = 0;
+  int down_layer_cnt = 0;
+  vector<string> view_params_names;
+  vector<string> view_folder_paths;
+  for (int i = 4; i < argc; i++) {
+    if (string(argv[i]) == "--temporal") {
+      temporal = true;
+    }
+    if (string(argv[i]) == "--view" && i + 2 < argc) {
+      view_params_names.push_back(argv[i + 1]);
+      view_folder_paths.push_back(argv[i + 2]);
+    }
+    if (i + 1 >= argc) {
+      continue;
+    }
+    if (string(argv[i]) == "--dense") {
+      dense_folder_path = argv[i + 1];
+    }
+    if (string(argv[i]) == "--cache") {
+      cache_folder_path = argv[i + 1];
+    }
+    if (string(argv[i]) == "--poses") {
+      poses_path = argv[i + 1];
+    }
+    if (string(argv[i]) == "--backend" &&
+        !set_parallel_backend(string(argv[i + 1]))) {
+      cout << "Unavailable parallel backend: " << argv[i + 1] << endl;
+      return 1;
+    }
+    if (string(argv[i]) == "--threads") {
+      set_parallel_threads(stoi(argv[i + 1]));
+    }
+    if (string(argv[i]) == "--schedule") {
+      schedule_name = argv[i + 1];
+      if (!parse_schedule_mode(schedule_name, schedule_mode)) {
+        cout << "Invalid schedule: " << schedule_name << endl;
+        return 1;
+      }
+    }
+    if (string(argv[i]) == "--max-latency") {
+      max_latency_ms = stod(argv[i + 1]);
+    }
+    if (string(argv[i]) == "--layers") {
+      down_layer_cnt = stoi(argv[i + 1]);
+    }
+  }
 
-    try {
-      string str = *it;
-      size_t found = str.find(".png");
-      if (found == string::npos) {
-        throw 1;
+  vector<EnvParams> view_params;
+  vector<HyperParams> view_hyper_params;
+  try {
+    for (int i = 0; i < view_params_names.size(); i++) {
+      view_params.push_back(load_env_params(view_params_names[i]));
+      view_hyper_params.push_back(load_hyper_params(view_params_names[i]));
+    }
+  } catch (const exception& e) {
+    cout << e.what() << endl;
+    return 1;
+  }
+
+  if (down_layer_cnt != 0) {
+    if (down_layer_cnt < 0 ||
+        down_layer_cnt > lidar_model(params_use).layer_cnt()) {
+      cout << "Invalid number of layers: " << down_layer_cnt << endl;
+      return 1;
+    }
+    params_use.down_layer_cnt = down_layer_cnt;
+    for (EnvParams& params : view_params) {
+      params.down_layer_cnt = down_layer_cnt;
+    }
+  }
+
+  // 1行に1フレーム: 名前とカメラ座標から世界座標への変換 (3x4, 行優先)
+  map<string, Eigen::Matrix4d> poses;
+  if (!poses_path.empty()) {
+    ifstream ifs(poses_path);
+    string name;
+    while (ifs >> name) {
+      Eigen::Matrix4d pose = Eigen::Matrix4d::Identity();
+      for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 4; c++) {
+          ifs >> pose(r, c);
+        }
       }
+      poses[name] = pose;
+    }
+  }
+
+  // pngのあるフレームを名前順に
+  vector<string> frame_names;
+  for (auto it = file_names.begin(); it != file_names.end(); it++) {
+    size_t found = it->find(".png");
+    if (found != string::npos) {
+      frame_names.push_back(it->substr(0, found));
+    }
+  }
+
+  // 前フレームに依存するのでtemporalはフレーム単位で並列化しない
+  if (temporal) {
+    schedule_mode = ScheduleMode::INTRA;
+  }
+
+  // 出力はフレームの順に行う
+  vector<string> outputs(frame_names.size());
+  vector<bool> finished(frame_names.size(), false);
+  int printed = 0;
+  mutex output_mutex;
+  auto output = [&](int idx, const string& lines) {
+    lock_guard<mutex> lock(output_mutex);
+    outputs[idx] = lines;
+    finished[idx] = true;
+    while (printed < frame_names.size() && finished[printed]) {
+      cout << outputs[printed];
+      outputs[printed].clear();
+      printed++;
+    }
+  };
 
-      string name = str.substr(0, found);
-      string img_path = data_folder_path + name + ".png";
-      cv::Mat img = cv::imread(img_path);
+  // フレームは名前順に連続しているものとする
+  InterpolationSession session(params_use, hyper_params, method_name);
+  string prev_name = "";
 
-      string pcd_path = data_folder_path + name + ".pcd";
+  FrameScheduler scheduler(schedule_mode, max_latency_ms);
+  ScheduleStats stats = scheduler.run(frame_names.size(), [&](int idx) {
+    string name = frame_names[idx];
+    ostringstream out;
+
+    try {
+      cv::Mat img;
       pcl::PointCloud<pcl::PointXYZ> cloud;
-      if (pcl::io::loadPCDFile<pcl::PointXYZ>(pcd_path, cloud) == -1) {
+      vector<uint16_t> rings;
+      if (!load_frame(data_folder_path, name, cache_folder_path, img, cloud,
+                      rings)) {
         throw 2;
       }
 
-      for (int i = 0; i < cloud.points.size(); i++) {
-        // Assign position for camera coordinates
-        // Right-handed coordinate system
-        double x = cloud.points[i].y;
-        double y = -cloud.points[i].z;
-        double z = -cloud.points[i].x;
+      // 複数のカメラ: 1行に1カメラ
+      if (!view_params_names.empty()) {
+        vector<CameraView> views(1 + view_params_names.size());
+        views[0] = {params_use, img, method_name, hyper_params};
+        for (int i = 0; i < view_params_names.size(); i++) {
+          views[i + 1] = {view_params[i],
+                          cv::imread(view_folder_paths[i] + name + ".png"),
+                          method_name, view_hyper_params[i]};
+          if (views[i + 1].img.empty()) {
+            throw 3;
+          }
+        }
 
-        cloud.points[i].x = x;
-        cloud.points[i].y = y;
-        cloud.points[i].z = z;
+        vector<ViewResult> results;
+        interpolate_views(cloud, views, results, &rings);
+        for (int i = 0; i < results.size(); i++) {
+          string view_name = i == 0 ? params_name : view_params_names[i - 1];
+          out << name << "," << view_name << "," << results[i].time << ","
+              << results[i].ssim << "," << results[i].mse << ","
+              << results[i].mre << "," << results[i].f_val << endl;
+        }
+        output(idx, out.str());
+        return;
       }
 
       double time, ssim, mse, mre, f_val;
-      interpolate(cloud, img, params_use, hyper_params, method_name, time, ssim,
-                  mse, mre, f_val, true);
+      cv::Mat dense;
+      cv::Mat* dense_ptr = dense_folder_path.empty() ? nullptr : &dense;
+      if (temporal) {
+        // 前フレームから現フレームへの自車の移動
+        Eigen::Matrix4d motion;
+        const Eigen::Matrix4d* motion_ptr = nullptr;
+        if (poses.count(prev_name) && poses.count(name)) {
+          motion = poses[name].inverse() * poses[prev_name];
+          motion_ptr = &motion;
+        }
+        session.interpolate(cloud, img, time, ssim, mse, mre, f_val,
+                            motion_ptr, dense_ptr, &rings);
+        prev_name = name;
+      } else {
+        // スケジューラを使うバッチ実行では点群を表示しない
+        interpolate(cloud, img, params_use, hyper_params, method_name, time,
+                    ssim, mse, mre, f_val, schedule_name.empty(), dense_ptr,
+                    &rings);
+      }
 
-      cout << name << "," << time << "," << ssim << "," << mse << "," << mre
-           << "," << f_val << endl;
+      if (!dense_folder_path.empty()) {
+        // 16bit PNG, depth[m] * 256 (KITTI format)
+        cv::Mat dense_png;
+        dense.convertTo(dense_png, CV_16UC1, 256);
+        cv::imwrite(dense_folder_path + name + ".png", dense_png);
+      }
+
+      out << name << "," << time << "," << ssim << "," << mse << "," << mre
+          << "," << f_val << endl;
 
     } catch (int e) {
+      string str = name + ".png";
       switch (e) {
-        case 1:
-          break;
         case 2:
-          cout << "Img " << str << ": The point cloud does not exist" << endl;
+          out << "Img " << str << ": The point cloud does not exist" << endl;
+          break;
+        case 3:
+          out << "Img " << str << ": The image of another view does not exist"
+              << endl;
           break;
       }
     }
+    output(idx, out.str());
+  });
+
+  // スループットと1フレームの処理時間 (標準出力は結果のみ)
+  if (!schedule_name.empty()) {
+    stats.print(cerr);
   }
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,130 @@
+#include <iostream>
+#include <memory>
+#include <sstream>
+
+#include <pcl/point_cloud.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <opencv2/opencv.hpp>
+
+#include "interpolate.cpp"
+#include "models.h"
+#include "service.h"
+
+using namespace std;
+
+// Online interpolation of the frames received from a Unix domain socket
+int main(int argc, char* argv[]) {
+  if (argc < 4) {
+    cout << "You must specify socket path, calibration setting name and "
+            "interpolation method names (e.g. original,linear)"
+         << endl;
+    return 1;
+  }
+
+  string socket_path = argv[1];
+  string params_name = argv[2];
+  shared_ptr<const ProfileRegistry> registry;
+  EnvParams params_use;
+  HyperParams hyper_params;
+  try {
+    registry = profiles();
+    params_use = registry->get(params_name).env_params;
+    hyper_params = registry->get(params_name).hyper_params;
+  } catch (const exception& e) {
+    cout << e.what() << endl;
+    return 1;
+  }
+
+  // 左から順に，締め切りに間に合わない場合の代わりの手法
+  ServiceConfig config;
+  config.methods.clear();
+  stringstream methods_stream(argv[3]);
+  string method_name;
+  while (getline(methods_stream, method_name, ',')) {
+    if (find_method(method_name) == nullptr) {
+      cout << "Unknown interpolation method name: " << method_name << endl;
+      return 1;
+    }
+    config.methods.push_back(method_name);
+  }
+  if (config.methods.empty()) {
+    cout << "No interpolation method is given" << endl;
+    return 1;
+  }
+
+  // 1フレームの締め切り (--deadline <ms>)
+  // 使っていない手法を測り直す間隔 (--probe <frames>, 0は測り直さない)
+  // 統計を出力する間隔 (--report <frames>)
+  int report_interval = 100;
+  for (int i = 4; i + 1 < argc; i++) {
+    if (string(argv[i]) == "--deadline") {
+      config.deadline_ms = stod(argv[i + 1]);
+    }
+    if (string(argv[i]) == "--probe") {
+      config.probe_interval = stoi(argv[i + 1]);
+    }
+    if (string(argv[i]) == "--report") {
+      report_interval = stoi(argv[i + 1]);
+    }
+  }
+
+  // 受け取ったフレームのリング (送られなければ空)
+  vector<uint16_t> rings;
+  InterpolationService service(
+      config, [&](const string& method, pcl::PointCloud<pcl::PointXYZ>& cloud,
+                  cv::Mat& img, cv::Mat& grid) {
+        cv::Mat blured;
+        guide_image(img, params_use, blured);
+        cv::Mat removed, vs, interpolated;
+        grid_input(cloud, params_use, removed, vs, &rings);
+        run_method(method, removed, vs, params_use, blured, hyper_params,
+                   interpolated);
+        remove_noise(interpolated, grid, vs, params_use);
+      });
+
+  int listen_fd = listen_unix_socket(socket_path);
+  if (listen_fd < 0) {
+    cout << "Failed to listen on " << socket_path << endl;
+    return 1;
+  }
+
+  while (true) {
+    int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd < 0) {
+      continue;
+    }
+
+    string name;
+    int64_t captured_ns;
+    cv::Mat img;
+    pcl::PointCloud<pcl::PointXYZ> cloud;
+    while (receive_frame(fd, name, captured_ns, img, cloud, &rings)) {
+      // 設定ファイルが更新されていれば，このフレームから反映する
+      shared_ptr<const ProfileRegistry> latest = profiles();
+      if (latest != registry) {
+        registry = latest;
+        if (registry->contains(params_name)) {
+          params_use = registry->get(params_name).env_params;
+          hyper_params = registry->get(params_name).hyper_params;
+          cout << "Reloaded " << params_name << endl;
+        } else {
+          cout << params_name << " was removed. Keeping the previous one"
+               << endl;
+        }
+      }
+
+      double elapsed_ms = (monotonic_ns() - captured_ns) / 1e6;
+      ServiceResult result = service.process(name, cloud, img, elapsed_ms);
+      if (!send_result(fd, result)) {
+        break;
+      }
+      if (report_interval > 0 &&
+          service.latency().count() % report_interval == 0) {
+        service.print_stats(cout);
+      }
+    }
+    close(fd);
+    service.print_stats(cout);
+  }
+}
@@ -0,0 +1,70 @@
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <random>
+
+#include <opencv2/opencv.hpp>
+
+#include "methods.h"
+#include "models.h"
+
+using namespace std;
+
+// Compare ip_basic with the cv::dilate implementation on random sparse grids
+int main(int argc, char* argv[]) {
+  // グリッドの幅，点の密度，繰り返し回数
+  int width = argc > 1 ? stoi(argv[1]) : 938;
+  double density = argc > 2 ? stod(argv[2]) : 0.3;
+  int iterations = argc > 3 ? stoi(argv[3]) : 100;
+
+  mt19937 engine(0);
+  uniform_real_distribution<double> dist(0, 1);
+  cv::Mat src_grid = cv::Mat::zeros(64, width, CV_64FC1);
+  for (int y = 0; y < src_grid.rows; y++) {
+    for (int x = 0; x < src_grid.cols; x++) {
+      if (dist(engine) < density) {
+        src_grid.at<double>(y, x) = 1 + 99 * dist(engine);
+      }
+    }
+  }
+  cv::Mat vs = cv::Mat::zeros(src_grid.rows, src_grid.cols, CV_16SC1);
+  EnvParams env_params{};
+
+  cv::Mat expected, actual;
+  auto start = chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    ip_basic_opencv(src_grid, expected, vs, env_params);
+  }
+  double opencv_time = chrono::duration<double, milli>(
+                           chrono::steady_clock::now() - start)
+                           .count() /
+                       iterations;
+
+  start = chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    ip_basic(src_grid, actual, vs, env_params);
+  }
+  double engine_time = chrono::duration<double, milli>(
+                           chrono::steady_clock::now() - start)
+                           .count() /
+                       iterations;
+
+  // ビット単位で一致するか
+  int mismatches = 0;
+  for (int y = 0; y < expected.rows; y++) {
+    for (int x = 0; x < expected.cols; x++) {
+      double a = expected.at<double>(y, x);
+      double b = actual.at<double>(y, x);
+      if (memcmp(&a, &b, sizeof(double)) != 0) {
+        mismatches++;
+      }
+    }
+  }
+
+  cout << "Grid = 64x" << width << ", density = " << density << endl;
+  cout << "cv::dilate = " << opencv_time << " ms" << endl;
+  cout << "engine = " << engine_time << " ms" << endl;
+  cout << "Speedup = " << opencv_time / engine_time << endl;
+  cout << "Mismatches = " << mismatches << endl;
+  return mismatches == 0 ? 0 : 1;
+}
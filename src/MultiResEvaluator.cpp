@@ -0,0 +1,194 @@
+#include <chrono>
+#include <iostream>
+#include <sstream>
+
+#include <dirent.h>
+#include <pcl/point_cloud.h>
+#include <opencv2/opencv.hpp>
+
+#include "frame_cache.h"
+#include "interpolate.cpp"
+#include "models.h"
+#include "parallel.h"
+
+using namespace std;
+
+namespace {
+vector<string> split(const string& list) {
+  vector<string> items;
+  stringstream ss(list);
+  string item;
+  while (getline(ss, item, ',')) {
+    if (!item.empty()) {
+      items.push_back(item);
+    }
+  }
+  return items;
+}
+
+// Sum of the results of a (layers, method) pair
+struct LevelResult {
+  int frame_cnt = 0;
+  double time = 0;
+  double ssim = 0;
+  double mse = 0;
+  double mre = 0;
+  double f_val = 0;
+};
+}  // namespace
+
+/*
+Evaluate the methods at several sparsities in one run
+全レイヤーのグリッドをフレームごとに1度だけ作り，行を消して各疎さの入力を作る
+*/
+int main(int argc, char* argv[]) {
+  if (argc < 3) {
+    cout << "You must specify data folder and calibration setting name"
+         << endl;
+    return 1;
+  }
+
+  string data_folder_path = argv[1];
+  DIR* dir;
+  struct dirent* diread;
+  set<string> file_names;
+  if ((dir = opendir(data_folder_path.c_str())) != nullptr) {
+    while ((diread = readdir(dir)) != nullptr) {
+      file_names.insert(diread->d_name);
+    }
+    closedir(dir);
+  } else {
+    cout << "Invalid folder path!" << endl;
+    return 1;
+  }
+
+  string params_name = argv[2];
+  EnvParams params_use;
+  HyperParams hyper_params;
+  try {
+    params_use = load_env_params(params_name);
+    hyper_params = load_hyper_params(params_name);
+  } catch (const exception& e) {
+    cout << e.what() << endl;
+    return 1;
+  }
+
+  // 評価する補完手法 (--methods <name,name,...>)
+  // 入力に残すレイヤー数 (--layers <N,N,...>)
+  // フレームキャッシュの保存先 (--cache <folder>)
+  // 並列実行のバックエンド (--backend serial|opencv|openmp|tbb)
+  // ワーカースレッド数 (--threads <N>, 0は全コア)
+  vector<string> methods = method_names();
+  vector<int> layer_cnts = {32, 16, 8, 4};
+  string cache_folder_path = "";
+  for (int i = 3; i + 1 < argc; i++) {
+    if (string(argv[i]) == "--methods") {
+      methods = split(argv[i + 1]);
+    }
+    if (string(argv[i]) == "--layers") {
+      layer_cnts.clear();
+      for (const string& item : split(argv[i + 1])) {
+        layer_cnts.push_back(stoi(item));
+      }
+    }
+    if (string(argv[i]) == "--cache") {
+      cache_folder_path = argv[i + 1];
+    }
+    if (string(argv[i]) == "--backend" &&
+        !set_parallel_backend(string(argv[i + 1]))) {
+      cout << "Unavailable parallel backend: " << argv[i + 1] << endl;
+      return 1;
+    }
+    if (string(argv[i]) == "--threads") {
+      set_parallel_threads(stoi(argv[i + 1]));
+    }
+  }
+
+  for (const string& method_name : methods) {
+    if (find_method(method_name) == nullptr) {
+      cout << "Unknown interpolation method name: " << method_name << endl;
+      return 1;
+    }
+  }
+
+  const LidarModel& lidar = lidar_model(params_use);
+  for (int layer_cnt : layer_cnts) {
+    if (layer_cnt <= 0 || layer_cnt > lidar.layer_cnt()) {
+      cout << "Invalid number of layers: " << layer_cnt << endl;
+      return 1;
+    }
+  }
+
+  vector<vector<LevelResult>> results(
+      layer_cnts.size(), vector<LevelResult>(methods.size()));
+  for (auto it = file_names.begin(); it != file_names.end(); it++) {
+    size_t found = it->find(".png");
+    if (found == string::npos) {
+      continue;
+    }
+    string name = it->substr(0, found);
+
+    cv::Mat img;
+    pcl::PointCloud<pcl::PointXYZ> cloud;
+    vector<uint16_t> rings;
+    if (!load_frame(data_folder_path, name, cache_folder_path, img, cloud,
+                    rings)) {
+      cout << "Img " << name << ".png: The point cloud does not exist"
+           << endl;
+      continue;
+    }
+
+    // 全レイヤーのグリッドは真値を兼ねる
+    cv::Mat blured, gt_grid, gt_vs;
+    guide_image(img, params_use, blured);
+    grid_pointcloud(cloud, lidar, params_use, gt_grid, gt_vs,
+                    GridReducer::NEAREST, &rings);
+    GroundTruthIndex gt_index;
+    build_ground_truth_index(gt_grid, 4, gt_index);
+
+    for (int l = 0; l < layer_cnts.size(); l++) {
+      cv::Mat masked, vs, removed;
+      mask_layers(gt_grid, gt_vs, lidar, params_use, layer_cnts[l], masked,
+                  vs);
+      remove_noise(masked, removed, vs, params_use);
+
+      for (int m = 0; m < methods.size(); m++) {
+        auto start = chrono::steady_clock::now();
+        cv::Mat interpolated, removed2;
+        run_method(methods[m], removed, vs, params_use, blured,
+                   hyper_params, interpolated);
+        remove_noise(interpolated, removed2, vs, params_use);
+        double time = chrono::duration<double, milli>(
+                          chrono::steady_clock::now() - start)
+                          .count();
+
+        double ssim, mse, mre, f_val;
+        evaluate(removed2, gt_grid, gt_index, params_use, ssim, mse, mre,
+                 f_val);
+        LevelResult& result = results[l][m];
+        result.frame_cnt++;
+        result.time += time;
+        result.ssim += ssim;
+        result.mse += mse;
+        result.mre += mre;
+        result.f_val += f_val;
+      }
+    }
+  }
+
+  // 1行に1つの(レイヤー数, 手法)．値はフレームの平均
+  cout << "layers,method,frames,time_ms,fps,ssim,mse,mre,f_val" << endl;
+  for (int l = 0; l < layer_cnts.size(); l++) {
+    for (int m = 0; m < methods.size(); m++) {
+      const LevelResult& result = results[l][m];
+      int n = max(1, result.frame_cnt);
+      double time = result.time / n;
+      cout << layer_cnts[l] << "," << methods[m] << ","
+           << result.frame_cnt << "," << time << ","
+           << (time > 0 ? 1000 / time : 0) << "," << result.ssim / n << ","
+           << result.mse / n << "," << result.mre / n << ","
+           << result.f_val / n << endl;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,100 @@
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include <dirent.h>
+#include <pcl/point_cloud.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <opencv2/opencv.hpp>
+
+#include "frame_cache.h"
+#include "service.h"
+
+using namespace std;
+
+// Send the frames in the data folder to InterpolationNode at a fixed rate
+int main(int argc, char* argv[]) {
+  if (argc < 3) {
+    cout << "You must specify socket path and data folder" << endl;
+    return 1;
+  }
+
+  string socket_path = argv[1];
+  string data_folder_path = argv[2];
+  DIR* dir;
+  struct dirent* diread;
+  set<string> file_names;
+  if ((dir = opendir(data_folder_path.c_str())) != nullptr) {
+    while ((diread = readdir(dir)) != nullptr) {
+      file_names.insert(diread->d_name);
+    }
+    closedir(dir);
+  } else {
+    cout << "Invalid folder path!" << endl;
+    return 1;
+  }
+
+  // 送信の頻度 (--rate <Hz>)
+  // フレームキャッシュの保存先 (--cache <folder>)
+  double rate = 10;
+  string cache_folder_path = "";
+  for (int i = 3; i + 1 < argc; i++) {
+    if (string(argv[i]) == "--rate") {
+      rate = stod(argv[i + 1]);
+    }
+    if (string(argv[i]) == "--cache") {
+      cache_folder_path = argv[i + 1];
+    }
+  }
+
+  vector<string> names;
+  for (auto it = file_names.begin(); it != file_names.end(); it++) {
+    size_t found = it->find(".png");
+    if (found != string::npos) {
+      names.push_back(it->substr(0, found));
+    }
+  }
+
+  int fd = connect_unix_socket(socket_path);
+  if (fd < 0) {
+    cout << "Failed to connect to " << socket_path << endl;
+    return 1;
+  }
+
+  // 結果は別スレッドで受け取る
+  thread receiver([fd]() {
+    ServiceResult result;
+    cout << "name,method,latency,fallback,deadline_missed" << endl;
+    while (receive_result(fd, result)) {
+      cout << result.name << "," << result.method << "," << result.latency_ms
+           << "," << result.fallback << "," << result.deadline_missed << endl;
+    }
+  });
+
+  auto interval = chrono::duration<double>(1 / rate);
+  auto next = chrono::steady_clock::now();
+  for (int i = 0; i < names.size(); i++) {
+    cv::Mat img;
+    pcl::PointCloud<pcl::PointXYZ> cloud;
+    vector<uint16_t> rings;
+    if (!load_frame(data_folder_path, names[i], cache_folder_path, img, cloud,
+                    rings)) {
+      cout << "Img " << names[i] << ".png: The point cloud does not exist"
+           << endl;
+      continue;
+    }
+
+    this_thread::sleep_until(next);
+    next += chrono::duration_cast<chrono::steady_clock::duration>(interval);
+    if (!send_frame(fd, names[i], monotonic_ns(), cloud, img, &rings)) {
+      cout << "Failed to send " << names[i] << endl;
+      break;
+    }
+  }
+
+  shutdown(fd, SHUT_WR);
+  receiver.join();
+  close(fd);
+  return 0;
+}
@@ -5,12 +5,14 @@
 #include <pcl/point_cloud.h>
 #include <opencv2/opencv.hpp>
 
+#include "frame_cache.h"
 #include "interpolate.cpp"
 #include "models.h"
+#include "search.h"
 
 using namespace std;
 
-// Grid search
+// Hyper parameter search
 int main(int argc, char* argv[]) {
   if (argc < 4) {
     cout << "You must specify data folder, calibration setting name and "
@@ -34,156 +36,243 @@ int main(int argc, char* argv[]) {
   }
 
   string params_name = argv[2];
-  EnvParams params_use = load_env_params(params_name);
-  HyperParams hyper_params = load_default_hyper_params();
+  EnvParams params_use;
+  HyperParams hyper_params;
+  try {
+    params_use = load_env_params(params_name);
+    hyper_params = load_hyper_params(params_name);
+  } catch (const exception& e) {
+    cout << e.what() << endl;
+    return 1;
+  }
 
   string method_name = argv[3];
-  if (!(method_name == "pwas" || method_name == "original")) {
-    cout << "You must specify 'pwas' or 'original' as interpolation method name"
+  vector<SearchDimension> space = search_space(method_name);
+  if (space.empty()) {
+    cout << "You must specify 'mrf', 'bilateral-solver', 'pwas', "
+            "'domain-transform', 'original' or 'pyramid' as interpolation "
+            "method name"
+         << endl;
+    return 1;
+  }
+
+  // フレームキャッシュの保存先 (--cache <folder>)
+  // 前処理済みグリッドを保持するメモリの上限 (--memory-budget <MB>)
+  // 探索方法 (--search grid|random|coarse-to-fine|halving)
+  // random, halvingで評価する候補数 (--trials <N>)
+  // 最良値を超えた候補の評価を打ち切らない (--no-pruning)
+  // pwasでまとめて評価する候補数 (--batch <N>)
+  string cache_folder_path = "";
+  double memory_budget_mb = -1;
+  string strategy_name = "grid";
+  int trials = 50;
+  int batch_size = 16;
+  bool pruning = true;
+  for (int i = 4; i < argc; i++) {
+    if (string(argv[i]) == "--no-pruning") {
+      pruning = false;
+    }
+    if (i + 1 >= argc) {
+      continue;
+    }
+    if (string(argv[i]) == "--cache") {
+      cache_folder_path = argv[i + 1];
+    }
+    if (string(argv[i]) == "--memory-budget") {
+      memory_budget_mb = stod(argv[i + 1]);
+    }
+    if (string(argv[i]) == "--search") {
+      strategy_name = argv[i + 1];
+    }
+    if (string(argv[i]) == "--trials") {
+      trials = stoi(argv[i + 1]);
+    }
+    if (string(argv[i]) == "--batch") {
+      batch_size = stoi(argv[i + 1]);
+    }
+  }
+
+  shared_ptr<SearchStrategy> strategy =
+      make_search_strategy(strategy_name, trials);
+  if (!strategy) {
+    cout << "You must specify 'grid', 'random', 'coarse-to-fine' or 'halving' "
+            "as search strategy"
          << endl;
     return 1;
   }
+  strategy->set_pruning(pruning);
 
-  vector<cv::Mat> imgs;
-  vector<pcl::PointCloud<pcl::PointXYZ>> clouds;
+  vector<string> names;
   for (auto it = file_names.begin(); it != file_names.end(); it++) {
-    string str = *it;
+    size_t found = it->find(".png");
+    if (found != string::npos) {
+      names.push_back(it->substr(0, found));
+    }
+  }
+
+  // 評価に使うフレームを先に選び，それだけを読み込む
+  // 最大で20データまで使用
+  int inc = names.size() >= 10 ? names.size() / 10 : 1;
+  int first = method_name == "original" ? 2 : 0;
+  vector<string> selected_names;
+  for (int i = first; i < names.size(); i += inc) {
+    selected_names.push_back(names[i]);
+  }
 
-    try {
-      string str = *it;
-      size_t found = str.find(".png");
-      if (found == string::npos) {
-        throw 1;
+  // 先頭の数フレームがデータ全体に分散するように並べ替える
+  // (successive halvingは先頭のフレームから評価する)
+  vector<string> ordered_names;
+  vector<bool> is_ordered(selected_names.size(), false);
+  int stride = 1;
+  while (stride < selected_names.size()) {
+    stride *= 2;
+  }
+  for (; stride >= 1; stride /= 2) {
+    for (int i = 0; i < selected_names.size(); i += stride) {
+      if (!is_ordered[i]) {
+        is_ordered[i] = true;
+        ordered_names.push_back(selected_names[i]);
       }
+    }
+  }
+  selected_names = ordered_names;
 
-      string name = str.substr(0, found);
-      string img_path = data_folder_path + name + ".png";
-      cv::Mat img = cv::imread(img_path);
+  // 点群は保持せず，ハイパーパラメータに依存しないグリッドのみを保持する
+  auto prepare = [&](const string& name, PreparedFrame& frame) -> bool {
+    cv::Mat img;
+    pcl::PointCloud<pcl::PointXYZ> cloud;
+    vector<uint16_t> rings;
+    if (!load_frame(data_folder_path, name, cache_folder_path, img, cloud,
+                    rings)) {
+      return false;
+    }
+    prepare_frame(cloud, img, params_use, frame, &rings);
+    return true;
+  };
 
-      string pcd_path = data_folder_path + name + ".pcd";
-      pcl::PointCloud<pcl::PointXYZ> cloud;
-      if (pcl::io::loadPCDFile<pcl::PointXYZ>(pcd_path, cloud) == -1) {
-        throw 2;
-      }
+  // 上限を超えるフレームは評価のたびに読み込み直す
+  vector<PreparedFrame> frames;
+  vector<string> spilled_names;
+  size_t resident_bytes = 0;
+  for (int i = 0; i < selected_names.size(); i++) {
+    PreparedFrame frame;
+    if (!prepare(selected_names[i], frame)) {
+      cout << "Img " << selected_names[i]
+           << ".png: The point cloud does not exist" << endl;
+      continue;
+    }
 
-      for (int i = 0; i < cloud.points.size(); i++) {
-        // Assign position for camera coordinates
-        // Right-handed coordinate system
-        double x = cloud.points[i].y;
-        double y = -cloud.points[i].z;
-        double z = -cloud.points[i].x;
+    if (memory_budget_mb >= 0 &&
+        resident_bytes + frame.bytes() > memory_budget_mb * 1024 * 1024) {
+      spilled_names.push_back(selected_names[i]);
+      continue;
+    }
+    resident_bytes += frame.bytes();
+    frames.push_back(frame);
+  }
+  if (!spilled_names.empty()) {
+    cout << spilled_names.size()
+         << " frames exceed the memory budget and are loaded on each "
+            "evaluation"
+         << endl;
+  }
 
-        cloud.points[i].x = x;
-        cloud.points[i].y = y;
-        cloud.points[i].z = z;
+  // 近傍インデックスも上限に含め，収まらなければ評価のたびに作り直す
+  bool index_spilled = false;
+  auto reserve = [&](size_t bytes) -> bool {
+    if (memory_budget_mb >= 0 &&
+        resident_bytes + bytes > memory_budget_mb * 1024 * 1024) {
+      if (!index_spilled) {
+        cout << "Neighbor indices exceed the memory budget and are rebuilt "
+                "on each evaluation"
+             << endl;
+        index_spilled = true;
       }
+      return false;
+    }
+    resident_bytes += bytes;
+    return true;
+  };
 
-      imgs.push_back(img);
-      clouds.push_back(cloud);
-    } catch (int e) {
-      switch (e) {
-        case 1:
-          break;
-        case 2:
-          cout << "Img " << str << ": The point cloud does not exist" << endl;
-          break;
-      }
+  int frame_cnt = frames.size() + spilled_names.size();
+  auto frame_mre = [&](const HyperParams& params, int i) -> double {
+    double ssim, mse, mre, f_val;
+    if (i < frames.size()) {
+      evaluate_prepared(frames[i], params_use, params, method_name, ssim, mse,
+                        mre, f_val, reserve);
+    } else {
+      PreparedFrame frame;
+      prepare(spilled_names[i - frames.size()], frame);
+      evaluate_prepared(frame, params_use, params, method_name, ssim, mse, mre,
+                        f_val);
     }
-  }
+    return mre;
+  };
 
-  // 最大で20データまで使用
-  int inc = imgs.size() >= 10 ? imgs.size() / 10 : 1;
-
-  if (method_name == "pwas") {
-    double best_mre_sum = 1000000;
-    double best_sigma_c = 1;
-    double best_sigma_s = 1;
-    double best_sigma_r = 1;
-    int best_r = 1;
-
-    for (double sigma_c = 10; sigma_c <= 100; sigma_c += 10) {
-      for (double sigma_s = 0.5; sigma_s <= 2.5; sigma_s += 0.5) {
-        for (double sigma_r = 1; sigma_r <= 10; sigma_r += 1) {
-          for (int r = 7; r <= 7; r += 1) {
-            double mre_sum = 0;
-            hyper_params.pwas_sigma_c = sigma_c;
-            hyper_params.pwas_sigma_s = sigma_s;
-            hyper_params.pwas_sigma_r = sigma_r;
-            hyper_params.pwas_r = r;
-            for (int i = 0; i < imgs.size(); i += inc) {
-              double time, ssim, mse, mre, f_val;
-              interpolate(clouds[i], imgs[i], params_use, hyper_params,
-                          method_name, time, ssim, mse, mre, f_val, false);
-              mre_sum += mre;
-            }
+  // pwasは近傍の走査を共有して複数のパラメータをまとめて評価する
+  if (method_name == "pwas" && batch_size > 1) {
+    strategy->set_batch_objective(
+        [&](const vector<HyperParams>& params, int i) -> vector<double> {
+          PreparedFrame spilled;
+          if (i >= frames.size()) {
+            prepare(spilled_names[i - frames.size()], spilled);
+          }
+          bool resident = i < frames.size();
+          PreparedFrame& frame = resident ? frames[i] : spilled;
 
-            if (best_mre_sum > mre_sum) {
-              best_mre_sum = mre_sum;
-              best_sigma_c = sigma_c;
-              best_sigma_s = sigma_s;
-              best_sigma_r = sigma_r;
-              best_r = r;
-              cout << "Updated : " << mre_sum / imgs.size() << "," << sigma_c
-                   << "," << sigma_s << "," << sigma_r << "," << r << endl;
-            }
+          map<int, vector<int>> groups;
+          for (int k = 0; k < params.size(); k++) {
+            groups[params[k].pwas_r].push_back(k);
           }
-        }
-      }
-    }
 
-    cout << endl;
-    cout << "Done." << endl;
-    cout << "Mean error = " << best_mre_sum / imgs.size() << endl;
-    cout << "Sigma C = " << best_sigma_c << endl;
-    cout << "Sigma S = " << best_sigma_s << endl;
-    cout << "Sigma R = " << best_sigma_r << endl;
-    cout << "R = " << best_r << endl;
-  }
-  if (method_name == "original") {
-    double best_mre_sum = 1000000;
-    double best_color_segment_k = 1;
-    double best_sigma_s = 1;
-    int best_r = 1;
-    double best_coef_s = 1;
-
-    for (double color_segment_k = 400; color_segment_k <= 500;
-         color_segment_k += 10) {
-      for (double sigma_s = 1.6; sigma_s <= 1.6; sigma_s += 0.1) {
-        for (int r = 7; r <= 7; r += 2) {
-          for (double coef_s = 0.2; coef_s <= 0.4; coef_s += 0.01) {
-            double mre_sum = 0;
-            hyper_params.original_color_segment_k = color_segment_k;
-            hyper_params.original_sigma_s = sigma_s;
-            hyper_params.original_r = r;
-            hyper_params.original_coef_s = coef_s;
-            for (int i = 2; i < imgs.size(); i += inc) {
-              double time, ssim, mse, mre, f_val;
-              interpolate(clouds[i], imgs[i], params_use, hyper_params,
-                          method_name, time, ssim, mse, mre, f_val, false);
-              mre_sum += mre;
+          vector<double> errors(params.size());
+          for (auto it = groups.begin(); it != groups.end(); it++) {
+            vector<PwasParams> pwas_params;
+            for (int k : it->second) {
+              pwas_params.push_back({params[k].pwas_sigma_c,
+                                     params[k].pwas_sigma_s,
+                                     params[k].pwas_sigma_r});
             }
-
-            if (best_mre_sum > mre_sum) {
-              best_mre_sum = mre_sum;
-              best_color_segment_k = color_segment_k;
-              best_sigma_s = sigma_s;
-              best_r = r;
-              best_coef_s = coef_s;
-              cout << "Updated : " << mre_sum / imgs.size() << ","
-                   << color_segment_k << "," << sigma_s << "," << r << ","
-                   << best_coef_s << endl;
+            shared_ptr<const NeighborIndex> neighbors = frame_neighbors(
+                frame, method_name, it->first,
+                resident ? reserve : function<bool(size_t)>());
+            vector<cv::Mat> interpolated;
+            pwas_batch(frame.removed, interpolated, frame.vs, frame.blured,
+                       pwas_params, *neighbors);
+            for (int n = 0; n < it->second.size(); n++) {
+              double ssim, mse, mre, f_val;
+              evaluate_interpolated(frame, interpolated[n], params_use, ssim,
+                                    mse, mre, f_val);
+              errors[it->second[n]] = mre;
             }
           }
+          return errors;
+        },
+        batch_size);
+  }
+
+  SearchResult result = strategy->search(
+      space, hyper_params, frame_mre, frame_cnt,
+      [](const SearchResult& updated) {
+        cout << "Updated : " << updated.error;
+        for (int i = 0; i < updated.values.size(); i++) {
+          cout << "," << updated.values[i];
         }
-      }
-    }
+        cout << endl;
+      });
+
+  double grid_size = 1;
+  for (int i = 0; i < space.size(); i++) {
+    grid_size *= space[i].grid().size();
+  }
 
-    cout << endl;
-    cout << "Done." << endl;
-    cout << "Mean error = " << best_mre_sum / imgs.size() << endl;
-    cout << "Sigma C = " << best_color_segment_k << endl;
-    cout << "Sigma S = " << best_sigma_s << endl;
-    cout << "R = " << best_r << endl;
-    cout << "Coef S = " << best_coef_s << endl;
+  cout << endl;
+  cout << "Done." << endl;
+  cout << "Mean error = " << result.error << endl;
+  for (int i = 0; i < result.values.size(); i++) {
+    cout << space[i].name << " = " << result.values[i] << endl;
   }
-}
\ No newline at end of file
+  cout << "Evaluations = " << result.evaluations << " / "
+       << grid_size * frame_cnt << " (grid search)" << endl;
+  cout << "Pruned evaluations = " << result.pruned_evaluations << endl;
+}
@@ -0,0 +1,77 @@
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <opencv2/core/hal/intrin.hpp>
+#include <opencv2/opencv.hpp>
+
+#include "color_distance.h"
+
+using namespace std;
+
+namespace {
+// Upper limit of the kept tables (about 1.5MB each)
+const int MAX_SHARED_LUTS = 16;
+
+mutex lut_mutex;
+map<double, shared_ptr<const ColorWeightLut>> shared_luts;
+}  // namespace
+
+ColorWeightLut::ColorWeightLut(double sigma) : table(MAX_COLOR_SSD + 1) {
+  for (int ssd = 0; ssd <= MAX_COLOR_SSD; ssd++) {
+    table[ssd] = exp(-sqrt((double)ssd) / 2 / sigma / sigma);
+  }
+}
+
+shared_ptr<const ColorWeightLut> ColorWeightLut::shared(double sigma) {
+  lock_guard<mutex> lock(lut_mutex);
+  auto found = shared_luts.find(sigma);
+  if (found != shared_luts.end()) {
+    return found->second;
+  }
+
+  // 上限を超えたら全て捨てる (使用中の表は呼び出し側が保持している)
+  if (shared_luts.size() >= MAX_SHARED_LUTS) {
+    shared_luts.clear();
+  }
+  shared_ptr<const ColorWeightLut> lut = make_shared<ColorWeightLut>(sigma);
+  shared_luts[sigma] = lut;
+  return lut;
+}
+
+void color_ssd_taps(const cv::Vec3b& center, const cv::Vec3b* colors,
+                    const int* samples, int cnt, int* ssd) {
+  // チャンネルごとに連続した配列に集める
+  thread_local vector<int> planes;
+  planes.resize(cnt * 3);
+  int* p0 = planes.data();
+  int* p1 = p0 + cnt;
+  int* p2 = p1 + cnt;
+  for (int n = 0; n < cnt; n++) {
+    const cv::Vec3b& c = colors[samples[n]];
+    p0[n] = c[0];
+    p1[n] = c[1];
+    p2[n] = c[2];
+  }
+
+  int n = 0;
+#if CV_SIMD128
+  cv::v_int32x4 c0 = cv::v_setall_s32(center[0]);
+  cv::v_int32x4 c1 = cv::v_setall_s32(center[1]);
+  cv::v_int32x4 c2 = cv::v_setall_s32(center[2]);
+  for (; n + 4 <= cnt; n += 4) {
+    cv::v_int32x4 d0 = cv::v_load(p0 + n) - c0;
+    cv::v_int32x4 d1 = cv::v_load(p1 + n) - c1;
+    cv::v_int32x4 d2 = cv::v_load(p2 + n) - c2;
+    cv::v_store(ssd + n, d0 * d0 + d1 * d1 + d2 * d2);
+  }
+#endif
+  for (; n < cnt; n++) {
+    int d0 = p0[n] - center[0];
+    int d1 = p1[n] - center[1];
+    int d2 = p2[n] - center[2];
+    ssd[n] = d0 * d0 + d1 * d1 + d2 * d2;
+  }
+}
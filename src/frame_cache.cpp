@@ -0,0 +1,387 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <fcntl.h>
+#include <pcl/conversions.h>
+#include <pcl/io/pcd_io.h>
+#include <pcl/point_cloud.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <opencv2/opencv.hpp>
+
+#include "frame_cache.h"
+
+using namespace std;
+
+namespace {
+const char CACHE_MAGIC[8] = {'P', 'I', 'F', 'R', 'A', 'M', 'E', 0};
+const uint32_t CACHE_VERSION = 2;
+
+static_assert(sizeof(FrameCacheHeader) == 64, "Unexpected header layout");
+static_assert(sizeof(pcl::PointXYZ) == 4 * sizeof(float),
+              "Unexpected pcl::PointXYZ layout");
+
+uint64_t align_up(uint64_t offset, uint64_t alignment) {
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+// The rings follow the image
+uint64_t rings_offset(const FrameCacheHeader& h) {
+  return align_up(h.img_offset + (uint64_t)h.img_rows * h.img_cols *
+                                     CV_ELEM_SIZE(h.img_type),
+                  64);
+}
+
+/*
+Whether the header describes a frame within length bytes
+ソケットから受け取ったデータも検証するので，オーバーフローしないように比較する
+*/
+bool valid_layout(const FrameCacheHeader& h, uint64_t length) {
+  if (memcmp(h.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+      h.version != CACHE_VERSION) {
+    return false;
+  }
+
+  int type = h.img_type;
+  if (h.img_rows <= 0 || h.img_cols <= 0 || type < 0 ||
+      type != CV_MAT_TYPE(type) || CV_MAT_DEPTH(type) > CV_64F ||
+      CV_MAT_CN(type) > 4) {
+    return false;
+  }
+
+  uint64_t row_bytes = (uint64_t)h.img_cols * CV_ELEM_SIZE(type);
+  if (h.points_offset > length ||
+      h.point_cnt > (length - h.points_offset) / sizeof(pcl::PointXYZ) ||
+      h.img_offset > length ||
+      (uint64_t)h.img_rows > (length - h.img_offset) / row_bytes) {
+    return false;
+  }
+  if (h.ring_cnt == 0) {
+    return true;
+  }
+  uint64_t offset = rings_offset(h);
+  return h.ring_cnt == h.point_cnt && offset <= length &&
+         h.ring_cnt <= (length - offset) / sizeof(uint16_t);
+}
+
+int64_t get_mtime(const string& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    return -1;
+  }
+  return (int64_t)st.st_mtime;
+}
+
+void to_camera_coordinates(pcl::PointCloud<pcl::PointXYZ>& cloud) {
+  for (int i = 0; i < cloud.points.size(); i++) {
+    // Assign position for camera coordinates
+    // Right-handed coordinate system
+    double x = cloud.points[i].y;
+    double y = -cloud.points[i].z;
+    double z = -cloud.points[i].x;
+
+    cloud.points[i].x = x;
+    cloud.points[i].y = y;
+    cloud.points[i].z = z;
+  }
+}
+
+/*
+Ring field of each point
+ドライバによって型が異なる(Velodyneはuint16，Ousterはuint8のものもある)
+*/
+bool read_rings(const pcl::PCLPointCloud2& blob, vector<uint16_t>& rings) {
+  for (const pcl::PCLPointField& field : blob.fields) {
+    if (field.name != "ring") {
+      continue;
+    }
+
+    size_t point_cnt = (size_t)blob.width * blob.height;
+    rings.resize(point_cnt);
+    for (size_t i = 0; i < point_cnt; i++) {
+      const uint8_t* p = blob.data.data() + (i / blob.width) * blob.row_step +
+                         (i % blob.width) * blob.point_step + field.offset;
+      if (field.datatype == pcl::PCLPointField::UINT8) {
+        rings[i] = *p;
+      } else if (field.datatype == pcl::PCLPointField::UINT16) {
+        uint16_t ring;
+        memcpy(&ring, p, sizeof(ring));
+        rings[i] = ring;
+      } else if (field.datatype == pcl::PCLPointField::UINT32) {
+        uint32_t ring;
+        memcpy(&ring, p, sizeof(ring));
+        rings[i] = min(ring, (uint32_t)UINT16_MAX);
+      } else {
+        rings.clear();
+        return false;
+      }
+    }
+    return true;
+  }
+  rings.clear();
+  return false;
+}
+
+bool decode_frame(const string& img_path, const string& pcd_path,
+                  cv::Mat& img, pcl::PointCloud<pcl::PointXYZ>& cloud,
+                  vector<uint16_t>& rings) {
+  img = cv::imread(img_path);
+  return load_cloud(pcd_path, cloud, rings);
+}
+}  // namespace
+
+MappedFrame::MappedFrame() : data(nullptr), length(0) {}
+
+MappedFrame::MappedFrame(MappedFrame&& other)
+    : data(other.data), length(other.length) {
+  other.data = nullptr;
+  other.length = 0;
+}
+
+MappedFrame& MappedFrame::operator=(MappedFrame&& other) {
+  if (this != &other) {
+    close();
+    data = other.data;
+    length = other.length;
+    other.data = nullptr;
+    other.length = 0;
+  }
+  return *this;
+}
+
+MappedFrame::~MappedFrame() { close(); }
+
+bool MappedFrame::open(const string& path) {
+  close();
+
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < sizeof(FrameCacheHeader)) {
+    ::close(fd);
+    return false;
+  }
+  void* ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (ptr == MAP_FAILED) {
+    return false;
+  }
+  data = ptr;
+  length = st.st_size;
+
+  // Validate the layout
+  if (!valid_layout(header(), length)) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+void MappedFrame::close() {
+  if (data != nullptr) {
+    munmap(data, length);
+  }
+  data = nullptr;
+  length = 0;
+}
+
+bool MappedFrame::is_open() const { return data != nullptr; }
+
+const FrameCacheHeader& MappedFrame::header() const {
+  return *(const FrameCacheHeader*)data;
+}
+
+const pcl::PointXYZ* MappedFrame::points() const {
+  return (const pcl::PointXYZ*)((const char*)data + header().points_offset);
+}
+
+cv::Mat MappedFrame::image() const {
+  const FrameCacheHeader& h = header();
+  return cv::Mat(h.img_rows, h.img_cols, h.img_type,
+                 (char*)data + h.img_offset);
+}
+
+const uint16_t* MappedFrame::rings() const {
+  const FrameCacheHeader& h = header();
+  if (h.ring_cnt == 0) {
+    return nullptr;
+  }
+  return (const uint16_t*)((const char*)data + rings_offset(h));
+}
+
+void MappedFrame::copy_cloud(pcl::PointCloud<pcl::PointXYZ>& cloud) const {
+  size_t point_cnt = header().point_cnt;
+  cloud = pcl::PointCloud<pcl::PointXYZ>();
+  cloud.points.resize(point_cnt);
+  memcpy(cloud.points.data(), points(), point_cnt * sizeof(pcl::PointXYZ));
+  cloud.width = point_cnt;
+  cloud.height = 1;
+}
+
+void MappedFrame::copy_rings(vector<uint16_t>& rings) const {
+  const uint16_t* src = this->rings();
+  if (src == nullptr) {
+    rings.clear();
+    return;
+  }
+  rings.assign(src, src + header().ring_cnt);
+}
+
+void encode_frame(const pcl::PointCloud<pcl::PointXYZ>& cloud,
+                  const cv::Mat& img, vector<char>& buffer, int64_t pcd_mtime,
+                  int64_t png_mtime, const vector<uint16_t>* rings) {
+  FrameCacheHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+  h.version = CACHE_VERSION;
+  h.point_cnt = cloud.points.size();
+  h.img_rows = img.rows;
+  h.img_cols = img.cols;
+  h.img_type = img.type();
+  h.pcd_mtime = pcd_mtime;
+  h.png_mtime = png_mtime;
+  h.points_offset = align_up(sizeof(h), 64);
+  h.img_offset = align_up(
+      h.points_offset + (uint64_t)h.point_cnt * sizeof(pcl::PointXYZ), 64);
+  if (rings != nullptr && rings->size() == h.point_cnt) {
+    h.ring_cnt = h.point_cnt;
+  }
+
+  size_t row_bytes = img.cols * img.elemSize();
+  buffer.assign(h.ring_cnt > 0 ? rings_offset(h) + h.ring_cnt * sizeof(uint16_t)
+                               : h.img_offset + row_bytes * img.rows,
+                0);
+  memcpy(buffer.data(), &h, sizeof(h));
+  memcpy(buffer.data() + h.points_offset, cloud.points.data(),
+         h.point_cnt * sizeof(pcl::PointXYZ));
+  for (int i = 0; i < img.rows; i++) {
+    memcpy(buffer.data() + h.img_offset + row_bytes * i, img.ptr(i),
+           row_bytes);
+  }
+  if (h.ring_cnt > 0) {
+    memcpy(buffer.data() + rings_offset(h), rings->data(),
+           h.ring_cnt * sizeof(uint16_t));
+  }
+}
+
+bool decode_frame(const char* data, size_t length, cv::Mat& img,
+                  pcl::PointCloud<pcl::PointXYZ>& cloud,
+                  vector<uint16_t>* rings) {
+  if (length < sizeof(FrameCacheHeader)) {
+    return false;
+  }
+  FrameCacheHeader h;
+  memcpy(&h, data, sizeof(h));
+  if (!valid_layout(h, length)) {
+    return false;
+  }
+
+  cloud = pcl::PointCloud<pcl::PointXYZ>();
+  cloud.points.resize(h.point_cnt);
+  memcpy(cloud.points.data(), data + h.points_offset,
+         h.point_cnt * sizeof(pcl::PointXYZ));
+  cloud.width = h.point_cnt;
+  cloud.height = 1;
+  cv::Mat(h.img_rows, h.img_cols, h.img_type, (void*)(data + h.img_offset))
+      .copyTo(img);
+  if (rings != nullptr) {
+    rings->resize(h.ring_cnt);
+    memcpy(rings->data(), data + rings_offset(h),
+           h.ring_cnt * sizeof(uint16_t));
+  }
+  return true;
+}
+
+bool write_frame_cache(const string& path,
+                       const pcl::PointCloud<pcl::PointXYZ>& cloud,
+                       const cv::Mat& img, int64_t pcd_mtime,
+                       int64_t png_mtime, const vector<uint16_t>* rings) {
+  vector<char> buffer;
+  encode_frame(cloud, img, buffer, pcd_mtime, png_mtime, rings);
+
+  // 書き込み途中のファイルを読まないように一時ファイルからrenameする
+  string tmp_path = path + ".tmp";
+  ofstream ofs(tmp_path, ios::binary | ios::trunc);
+  if (!ofs) {
+    return false;
+  }
+  ofs.write(buffer.data(), buffer.size());
+  ofs.close();
+  if (!ofs) {
+    remove(tmp_path.c_str());
+    return false;
+  }
+  return rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+bool map_frame(const string& data_folder_path, const string& name,
+               const string& cache_folder_path, MappedFrame& frame) {
+  string img_path = data_folder_path + name + ".png";
+  string pcd_path = data_folder_path + name + ".pcd";
+  string cache_path = cache_folder_path + name + ".frame";
+  int64_t pcd_mtime = get_mtime(pcd_path);
+  int64_t png_mtime = get_mtime(img_path);
+
+  if (frame.open(cache_path) && frame.header().pcd_mtime == pcd_mtime &&
+      frame.header().png_mtime == png_mtime) {
+    return true;
+  }
+  frame.close();
+
+  cv::Mat img;
+  pcl::PointCloud<pcl::PointXYZ> cloud;
+  vector<uint16_t> rings;
+  if (!decode_frame(img_path, pcd_path, img, cloud, rings)) {
+    return false;
+  }
+  if (!write_frame_cache(cache_path, cloud, img, pcd_mtime, png_mtime,
+                         &rings)) {
+    return false;
+  }
+  return frame.open(cache_path);
+}
+
+bool load_frame(const string& data_folder_path, const string& name,
+                const string& cache_folder_path, cv::Mat& img,
+                pcl::PointCloud<pcl::PointXYZ>& cloud,
+                vector<uint16_t>& rings) {
+  if (!cache_folder_path.empty()) {
+    MappedFrame frame;
+    if (map_frame(data_folder_path, name, cache_folder_path, frame)) {
+      frame.image().copyTo(img);
+      frame.copy_cloud(cloud);
+      frame.copy_rings(rings);
+      return true;
+    }
+  }
+
+  return decode_frame(data_folder_path + name + ".png",
+                      data_folder_path + name + ".pcd", img, cloud, rings);
+}
+
+bool load_frame(const string& data_folder_path, const string& name,
+                const string& cache_folder_path, cv::Mat& img,
+                pcl::PointCloud<pcl::PointXYZ>& cloud) {
+  vector<uint16_t> rings;
+  return load_frame(data_folder_path, name, cache_folder_path, img, cloud,
+                    rings);
+}
+
+bool load_cloud(const string& pcd_path, pcl::PointCloud<pcl::PointXYZ>& cloud,
+                vector<uint16_t>& rings) {
+  pcl::PCLPointCloud2 blob;
+  if (pcl::io::loadPCDFile(pcd_path, blob) == -1) {
+    return false;
+  }
+  // x, y, z以外のフィールド(intensityなど)は無視される
+  pcl::fromPCLPointCloud2(blob, cloud);
+  read_rings(blob, rings);
+  to_camera_coordinates(cloud);
+  return true;
+}
@@ -1,79 +1,232 @@
 #pragma once
 #include <chrono>
+#include <functional>
 #include <map>
+#include <memory>
+#include <stdexcept>
 #include <vector>
 
+#include <Eigen/Core>
 #include <pcl/point_cloud.h>
 #include <pcl/visualization/cloud_viewer.h>
 #include <time.h>
 #include <opencv2/opencv.hpp>
 
+#include "lidar.h"
 #include "methods.h"
 #include "models.h"
+#include "parallel.h"
 #include "postprocess.h"
 #include "preprocess.h"
+#include "temporal.h"
 
 using namespace std;
 
-void interpolate(pcl::PointCloud<pcl::PointXYZ> &src_cloud, cv::Mat &img,
-                 EnvParams env_params, HyperParams hyper_params,
-                 string method_name, double &time, double &ssim, double &mse,
-                 double &mre, double &f_val, bool show_cloud = false)
+// Guide image of the interpolation (undistorted and blurred)
+void guide_image(cv::Mat &img, EnvParams &env_params, cv::Mat &blured)
 {
-  cv::Mat blured;
-  cv::GaussianBlur(img, blured, cv::Size(5, 5), 1.0);
+  cv::Mat undistorted;
+  undistort_image(img, undistorted, env_params);
+  cv::GaussianBlur(undistorted, blured, cv::Size(5, 5), 1.0);
+}
 
-  auto start = chrono::system_clock::now();
-  pcl::PointCloud<pcl::PointXYZ> downsampled;
-  int height = 64;
-  double min_angle_degree = -16.6;
-  double max_angle_degree = 16.6;
-
-  // 16レイヤーに変換　
-  downsample(src_cloud, downsampled, min_angle_degree, max_angle_degree, 64,
-             16);
+/*
+Grid the downsampled point cloud for the camera, and remove noises
+ringsがあればレイヤーをリング番号から引く(以下同様)
+*/
+void grid_downsampled(pcl::PointCloud<pcl::PointXYZ> &downsampled,
+                      EnvParams &env_params, cv::Mat &removed, cv::Mat &vs,
+                      const vector<uint16_t> *rings = nullptr)
+{
   // ２次元に変換
-  cv::Mat grid, vs;
-  grid_pointcloud(downsampled, min_angle_degree, max_angle_degree, height,
-                  env_params, grid, vs);
+  cv::Mat grid;
+  grid_pointcloud(downsampled, lidar_model(env_params), env_params, grid, vs,
+                  GridReducer::NEAREST, rings);
 
   // 悪天候ノイズ除去
-  cv::Mat removed;
   remove_noise(grid, removed, vs, env_params);
+}
 
-  cv::Mat interpolated;
+/*
+Grid the input point cloud
+env_params.down_layer_cnt本のレイヤーに間引いてグリッド化し，悪天候ノイズを除去する
+*/
+void grid_input(pcl::PointCloud<pcl::PointXYZ> &src_cloud,
+                EnvParams &env_params, cv::Mat &removed, cv::Mat &vs,
+                const vector<uint16_t> *rings = nullptr)
+{
+  pcl::PointCloud<pcl::PointXYZ> downsampled;
+  vector<uint16_t> down_rings;
+  downsample(src_cloud, downsampled, lidar_model(env_params),
+             env_params.down_layer_cnt, rings, &down_rings);
+  grid_downsampled(downsampled, env_params, removed, vs, &down_rings);
+}
 
-  // 補完
-  if (method_name == "linear")
+// Grid the full point cloud as the ground truth
+void grid_ground_truth(pcl::PointCloud<pcl::PointXYZ> &src_cloud,
+                       EnvParams &env_params, cv::Mat &gt_grid,
+                       const vector<uint16_t> *rings = nullptr)
+{
+  cv::Mat gt_vs;
+  grid_pointcloud(src_cloud, lidar_model(env_params), env_params, gt_grid,
+                  gt_vs, GridReducer::NEAREST, rings);
+}
+
+/*
+Interpolate the grid by the method
+pwas, originalはneighborsが与えられればそれを使い，近傍を走査し直さない
+Throws invalid_argument for an unknown method name
+*/
+void run_method(string method_name, cv::Mat &removed, cv::Mat &vs,
+                EnvParams &env_params, cv::Mat &blured,
+                HyperParams &hyper_params, cv::Mat &interpolated,
+                const NeighborIndex *neighbors = nullptr)
+{
+  if (neighbors != nullptr && method_name == "pwas")
   {
-    linear(removed, interpolated, vs, env_params);
+    pwas(removed, interpolated, vs, blured, hyper_params.pwas_sigma_c,
+         hyper_params.pwas_sigma_s, hyper_params.pwas_sigma_r, *neighbors);
+    return;
   }
-  if (method_name == "ip-basic")
+  if (neighbors != nullptr && method_name == "original")
   {
-    ip_basic(removed, interpolated, vs, env_params);
+    original(removed, interpolated, vs, env_params, blured,
+             hyper_params.original_color_segment_k,
+             hyper_params.original_sigma_s, *neighbors,
+             hyper_params.original_coef_s);
+    return;
   }
-  if (method_name == "guided-filter")
+
+  const InterpolationMethod *method = find_method(method_name);
+  if (method == nullptr)
   {
-    guided_filter(removed, interpolated, vs, env_params, blured);
+    throw invalid_argument("Unknown interpolation method name: " +
+                           method_name);
   }
-  if (method_name == "mrf")
+  (*method)(removed, interpolated, vs, env_params, blured, hyper_params);
+}
+
+/*
+Hyper parameter independent data of a frame
+点群を保持せずに評価を繰り返すためのグリッド
+*/
+struct PreparedFrame
+{
+  cv::Mat removed;
+  cv::Mat vs;
+  cv::Mat gt_grid;
+  // Valid cells of gt_grid, shared by every evaluation of the frame
+  GroundTruthIndex gt_index;
+  cv::Mat blured;
+  // Neighbor indices of removed for each (method, window size)
+  map<pair<string, double>, shared_ptr<NeighborIndex>> neighbors;
+
+  size_t bytes() const
+  {
+    size_t total = removed.total() * removed.elemSize() +
+                   vs.total() * vs.elemSize() +
+                   gt_grid.total() * gt_grid.elemSize() +
+                   blured.total() * blured.elemSize() + gt_index.bytes();
+    for (auto it = neighbors.begin(); it != neighbors.end(); it++)
+    {
+      total += it->second->bytes();
+    }
+    return total;
+  }
+};
+
+/*
+Neighbor index of the frame, built on the first use
+ハイパーパラメータ探索で窓の大きさが変わらない限り使い回す
+reserveがあれば保持する前にそのバイト数で呼び，falseなら保持せずに返す
+*/
+shared_ptr<const NeighborIndex> frame_neighbors(
+    PreparedFrame &frame, string method_name, double r,
+    const function<bool(size_t)> &reserve = nullptr)
+{
+  pair<string, double> key(method_name, r);
+  auto found = frame.neighbors.find(key);
+  if (found != frame.neighbors.end())
   {
-    mrf(removed, interpolated, vs, env_params, blured, hyper_params.mrf_k,
-        hyper_params.mrf_c);
+    return found->second;
   }
+
+  vector<cv::Point> window;
   if (method_name == "pwas")
   {
-    pwas(removed, interpolated, vs, blured, hyper_params.pwas_sigma_c,
-         hyper_params.pwas_sigma_s, hyper_params.pwas_sigma_r,
-         hyper_params.pwas_r);
+    window = pwas_window(r);
   }
-  if (method_name == "original")
+  else if (method_name == "original")
   {
-    original(removed, interpolated, vs, env_params, blured,
-             hyper_params.original_color_segment_k,
-             hyper_params.original_sigma_s, hyper_params.original_r,
-             hyper_params.original_coef_s);
+    window = ext_jbu_window(r);
   }
+  else
+  {
+    return nullptr;
+  }
+  shared_ptr<NeighborIndex> neighbors = make_shared<NeighborIndex>();
+  build_neighbor_index(frame.removed, window, *neighbors);
+  if (!reserve || reserve(neighbors->bytes()))
+  {
+    frame.neighbors[key] = neighbors;
+  }
+  return neighbors;
+}
+
+void prepare_frame(pcl::PointCloud<pcl::PointXYZ> &src_cloud, cv::Mat &img,
+                   EnvParams env_params, PreparedFrame &frame,
+                   const vector<uint16_t> *rings = nullptr)
+{
+  guide_image(img, env_params, frame.blured);
+  grid_input(src_cloud, env_params, frame.removed, frame.vs, rings);
+  grid_ground_truth(src_cloud, env_params, frame.gt_grid, rings);
+  build_ground_truth_index(frame.gt_grid, 4, frame.gt_index);
+}
+
+// Evaluate the interpolated grid of the frame
+void evaluate_interpolated(PreparedFrame &frame, cv::Mat &interpolated,
+                           EnvParams env_params, double &ssim, double &mse,
+                           double &mre, double &f_val)
+{
+  cv::Mat removed2;
+  remove_noise(interpolated, removed2, frame.vs, env_params);
+  evaluate(removed2, frame.gt_grid, frame.gt_index, env_params, ssim, mse,
+           mre, f_val);
+}
+
+void evaluate_prepared(PreparedFrame &frame, EnvParams env_params,
+                       HyperParams hyper_params, string method_name,
+                       double &ssim, double &mse, double &mre, double &f_val,
+                       const function<bool(size_t)> &reserve = nullptr)
+{
+  double r = method_name == "pwas" ? hyper_params.pwas_r
+                                   : hyper_params.original_r;
+  shared_ptr<const NeighborIndex> neighbors =
+      frame_neighbors(frame, method_name, r, reserve);
+  cv::Mat interpolated;
+  run_method(method_name, frame.removed, frame.vs, env_params, frame.blured,
+             hyper_params, interpolated, neighbors.get());
+  evaluate_interpolated(frame, interpolated, env_params, ssim, mse, mre,
+                        f_val);
+}
+
+void interpolate(pcl::PointCloud<pcl::PointXYZ> &src_cloud, cv::Mat &img,
+                 EnvParams env_params, HyperParams hyper_params,
+                 string method_name, double &time, double &ssim, double &mse,
+                 double &mre, double &f_val, bool show_cloud, cv::Mat *dense,
+                 const vector<uint16_t> *rings = nullptr)
+{
+  cv::Mat blured;
+  guide_image(img, env_params, blured);
+
+  auto start = chrono::system_clock::now();
+  cv::Mat removed, vs;
+  grid_input(src_cloud, env_params, removed, vs, rings);
+
+  // 補完
+  cv::Mat interpolated;
+  run_method(method_name, removed, vs, env_params, blured, hyper_params,
+             interpolated);
 
   // 補完ノイズ除去
   cv::Mat removed2;
@@ -84,11 +237,16 @@ void interpolate(pcl::PointCloud<pcl::PointXYZ> &src_cloud, cv::Mat &img,
              chrono::system_clock::now() - start)
              .count();
 
-  cv::Mat gt_grid, gt_vs;
-  grid_pointcloud(src_cloud, min_angle_degree, max_angle_degree, height,
-                  env_params, gt_grid, gt_vs);
+  cv::Mat gt_grid;
+  grid_ground_truth(src_cloud, env_params, gt_grid, rings);
   evaluate(removed2, gt_grid, env_params, ssim, mse, mre, f_val);
 
+  // 画像と同じ解像度の深度マップ
+  if (dense != nullptr)
+  {
+    upsample_dense(removed2, vs, env_params, *dense);
+  }
+
   if (show_cloud)
   {
     pcl::PointCloud<pcl::PointXYZ> dst_cloud;
@@ -101,4 +259,239 @@ void interpolate(pcl::PointCloud<pcl::PointXYZ> &src_cloud, cv::Mat &img,
     {
     }
   }
-}
\ No newline at end of file
+}
+
+void interpolate(pcl::PointCloud<pcl::PointXYZ> &src_cloud, cv::Mat &img,
+                 EnvParams env_params, HyperParams hyper_params,
+                 string method_name, double &time, double &ssim, double &mse,
+                 double &mre, double &f_val, bool show_cloud = false)
+{
+  interpolate(src_cloud, img, env_params, hyper_params, method_name, time,
+              ssim, mse, mre, f_val, show_cloud, nullptr);
+}
+
+// A camera to interpolate the LiDAR frame into
+struct CameraView
+{
+  EnvParams env_params;
+  cv::Mat img;
+  string method_name;
+  HyperParams hyper_params;
+};
+
+struct ViewResult
+{
+  cv::Mat vs;
+  // Interpolated grid after the noise removal
+  cv::Mat grid;
+  double time;
+  double ssim;
+  double mse;
+  double mre;
+  double f_val;
+};
+
+/*
+Interpolate one LiDAR frame into several cameras
+カメラに依存しない間引きは一度だけ行い，カメラごとにグリッド化と補完を行う
+timeは共通部分の時間を含む
+*/
+void interpolate_views(pcl::PointCloud<pcl::PointXYZ> &src_cloud,
+                       vector<CameraView> &views, vector<ViewResult> &results,
+                       const vector<uint16_t> *rings = nullptr)
+{
+  results.resize(views.size());
+  if (views.empty())
+  {
+    return;
+  }
+
+  auto start = chrono::system_clock::now();
+  pcl::PointCloud<pcl::PointXYZ> downsampled;
+  vector<uint16_t> down_rings;
+  // 全てのカメラは同じLiDARを見るので，最初のカメラの設定で間引く
+  downsample(src_cloud, downsampled, lidar_model(views.front().env_params),
+             views.front().env_params.down_layer_cnt, rings, &down_rings);
+  double shared_time = chrono::duration_cast<chrono::milliseconds>(
+                           chrono::system_clock::now() - start)
+                           .count();
+
+  auto run_view = [&](int i)
+  {
+    CameraView &view = views[i];
+    ViewResult &result = results[i];
+    cv::Mat blured;
+    guide_image(view.img, view.env_params, blured);
+
+    auto view_start = chrono::system_clock::now();
+    cv::Mat removed;
+    grid_downsampled(downsampled, view.env_params, removed, result.vs,
+                     &down_rings);
+
+    cv::Mat interpolated;
+    run_method(view.method_name, removed, result.vs, view.env_params, blured,
+               view.hyper_params, interpolated);
+    remove_noise(interpolated, result.grid, result.vs, view.env_params);
+    result.time = shared_time +
+                  chrono::duration_cast<chrono::milliseconds>(
+                      chrono::system_clock::now() - view_start)
+                      .count();
+
+    cv::Mat gt_grid;
+    grid_ground_truth(src_cloud, view.env_params, gt_grid, rings);
+    evaluate(result.grid, gt_grid, view.env_params, result.ssim, result.mse,
+             result.mre, result.f_val);
+  };
+
+  // カメラの数がスレッド数に満たなければ，順に処理してカメラ内の並列化に任せる
+  if (views.size() >= parallel_threads())
+  {
+    parallel_for(0, views.size(), [&](int begin, int end) {
+      for (int i = begin; i < end; i++)
+      {
+        run_view(i);
+      }
+    });
+  }
+  else
+  {
+    for (int i = 0; i < views.size(); i++)
+    {
+      run_view(i);
+    }
+  }
+}
+
+/*
+Interpolation of a sequence of frames
+前フレームの結果を保持し，mrfは前フレームの解から反復を始め，
+局所的な手法(pwas, original, guided-filter)は変化したタイルのみ計算し直す
+*/
+class InterpolationSession
+{
+  EnvParams env_params;
+  HyperParams hyper_params;
+  string method_name;
+
+  // Tile-wise recomputation of the local methods. nullptr for the others
+  shared_ptr<DirtyTileFilter> filter;
+
+  bool has_prev;
+  cv::Mat prev_vs;
+  cv::Mat prev_interpolated;
+
+public:
+  InterpolationSession(EnvParams env_params, HyperParams hyper_params,
+                       string method_name, TileParams tile_params = TileParams())
+      : env_params(env_params),
+        hyper_params(hyper_params),
+        method_name(method_name),
+        has_prev(false)
+  {
+    if (method_name == "pwas")
+    {
+      filter = pwas_tile_filter(
+          hyper_params.pwas_sigma_c, hyper_params.pwas_sigma_s,
+          hyper_params.pwas_sigma_r, hyper_params.pwas_r, tile_params);
+    }
+    if (method_name == "original")
+    {
+      filter = original_tile_filter(hyper_params.original_color_segment_k,
+                                    hyper_params.original_sigma_s,
+                                    hyper_params.original_r,
+                                    hyper_params.original_coef_s, tile_params);
+    }
+    if (method_name == "guided-filter")
+    {
+      filter = guided_filter_tile_filter(env_params, tile_params);
+    }
+  }
+
+  // Forget the previous frame (e.g. at the start of another sequence)
+  void reset()
+  {
+    has_prev = false;
+    if (filter)
+    {
+      filter->reset();
+    }
+  }
+
+  /*
+  Interpolate the grid of the next frame
+  motionは前フレームのカメラ座標から現フレームのカメラ座標への変換
+  */
+  void process(cv::Mat &removed, cv::Mat &vs, cv::Mat &blured,
+               cv::Mat &interpolated, const Eigen::Matrix4d *motion = nullptr)
+  {
+    bool moved = motion != nullptr && !motion->isIdentity(1e-9);
+
+    if (filter)
+    {
+      // 自車が動いた場合はタイルを使い回せない
+      if (moved)
+      {
+        filter->reset();
+      }
+      (*filter)(removed, interpolated, vs, blured);
+    }
+    else if (has_prev && method_name == "mrf")
+    {
+      // 前フレームの解を自車の移動分だけずらして初期値にする
+      cv::Mat initial_grid = prev_interpolated;
+      if (moved)
+      {
+        warp_grid(prev_interpolated, prev_vs, env_params, *motion,
+                  lidar_model(env_params), initial_grid);
+      }
+      mrf(removed, interpolated, vs, env_params, blured, hyper_params.mrf_k,
+          hyper_params.mrf_c, initial_grid);
+    }
+    else
+    {
+      run_method(method_name, removed, vs, env_params, blured, hyper_params,
+                 interpolated);
+    }
+
+    has_prev = true;
+    prev_vs = vs.clone();
+    prev_interpolated = interpolated.clone();
+  }
+
+  // Same as interpolate() for the next frame of the sequence
+  void interpolate(pcl::PointCloud<pcl::PointXYZ> &src_cloud, cv::Mat &img,
+                   double &time, double &ssim, double &mse, double &mre,
+                   double &f_val, const Eigen::Matrix4d *motion = nullptr,
+                   cv::Mat *dense = nullptr,
+                   const vector<uint16_t> *rings = nullptr)
+  {
+    cv::Mat blured;
+    guide_image(img, env_params, blured);
+
+    auto start = chrono::system_clock::now();
+    cv::Mat removed, vs;
+    grid_input(src_cloud, env_params, removed, vs, rings);
+
+    // 補完
+    cv::Mat interpolated;
+    process(removed, vs, blured, interpolated, motion);
+
+    // 補完ノイズ除去
+    cv::Mat removed2;
+    remove_noise(interpolated, removed2, vs, env_params);
+
+    // 評価
+    time = chrono::duration_cast<chrono::milliseconds>(
+               chrono::system_clock::now() - start)
+               .count();
+
+    cv::Mat gt_grid;
+    grid_ground_truth(src_cloud, env_params, gt_grid, rings);
+    evaluate(removed2, gt_grid, env_params, ssim, mse, mre, f_val);
+
+    if (dense != nullptr)
+    {
+      upsample_dense(removed2, vs, env_params, *dense);
+    }
+  }
+};
@@ -0,0 +1,96 @@
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <stdexcept>
+
+#include "lidar.h"
+
+using namespace std;
+
+LidarModel::LidarModel() : is_uniform(false), min_rad(0), delta_rad(0) {}
+
+LidarModel LidarModel::uniform(const string& name, int layer_cnt,
+                               double min_angle_degree,
+                               double max_angle_degree, bool ring_ascending) {
+  if (layer_cnt < 2 || max_angle_degree <= min_angle_degree) {
+    throw runtime_error("LiDAR '" + name + "': Invalid layers or angles");
+  }
+
+  double PI = acos(-1);
+  LidarModel model;
+  model.model_name = name;
+  model.is_uniform = true;
+  model.min_rad = min_angle_degree * PI / 180;
+  model.delta_rad =
+      (max_angle_degree - min_angle_degree) / (layer_cnt - 1) * PI / 180;
+  for (int l = 0; l < layer_cnt; l++) {
+    model.layer_rads.push_back(model.min_rad + l * model.delta_rad);
+    model.ring_layers.push_back(ring_ascending ? layer_cnt - 1 - l : l);
+  }
+  return model;
+}
+
+LidarModel LidarModel::from_elevations(
+    const string& name, const vector<double>& elevation_degrees) {
+  int ring_cnt = elevation_degrees.size();
+  if (ring_cnt < 2) {
+    throw runtime_error("LiDAR '" + name + "': At least 2 beams are needed");
+  }
+
+  // カメラ座標系ではyが下向きなので，仰角の符号を反転する
+  double PI = acos(-1);
+  vector<double> rads(ring_cnt);
+  for (int ring = 0; ring < ring_cnt; ring++) {
+    rads[ring] = -elevation_degrees[ring] * PI / 180;
+  }
+  vector<int> rings(ring_cnt);
+  iota(rings.begin(), rings.end(), 0);
+  stable_sort(rings.begin(), rings.end(),
+              [&](int a, int b) { return rads[a] < rads[b]; });
+
+  LidarModel model;
+  model.model_name = name;
+  model.ring_layers.resize(ring_cnt);
+  for (int l = 0; l < ring_cnt; l++) {
+    model.layer_rads.push_back(rads[rings[l]]);
+    model.ring_layers[rings[l]] = l;
+  }
+
+  // 隣り合うビームの中点で区切り，両端は半間隔だけ広げる
+  const vector<double>& layer_rads = model.layer_rads;
+  model.bounds.push_back(layer_rads[0] - (layer_rads[1] - layer_rads[0]) / 2);
+  for (int l = 1; l < ring_cnt; l++) {
+    model.bounds.push_back((layer_rads[l - 1] + layer_rads[l]) / 2);
+  }
+  model.bounds.push_back(layer_rads[ring_cnt - 1] +
+                         (layer_rads[ring_cnt - 1] - layer_rads[ring_cnt - 2]) /
+                             2);
+  return model;
+}
+
+const string& LidarModel::name() const { return model_name; }
+
+int LidarModel::layer_cnt() const { return layer_rads.size(); }
+
+int LidarModel::ring_cnt() const { return ring_layers.size(); }
+
+double LidarModel::layer_rad(int layer) const { return layer_rads[layer]; }
+
+int LidarModel::layer_of(double y, double r) const {
+  double rad = atan2(y, r);
+  if (is_uniform) {
+    int idx = (int)((rad - min_rad) / delta_rad);
+    return idx < 0 || idx >= layer_rads.size() ? -1 : idx;
+  }
+
+  if (rad < bounds.front() || rad >= bounds.back()) {
+    return -1;
+  }
+  return upper_bound(bounds.begin(), bounds.end(), rad) - bounds.begin() - 1;
+}
+
+const LidarModel& lidar_model(const EnvParams& env_params) {
+  static const LidarModel default_model =
+      LidarModel::uniform("default", 64, -16.6, 16.6);
+  return env_params.lidar ? *env_params.lidar : default_model;
+}
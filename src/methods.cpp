@@ -1,9 +1,14 @@
+#include <map>
+
 #include <Eigen/Core>
 #include <Eigen/Sparse>
 #include <opencv2/opencv.hpp>
 
+#include "color_distance.h"
 #include "methods.h"
 #include "models.h"
+#include "morphology.h"
+#include "parallel.h"
 #include "utils.h"
 
 using namespace std;
@@ -13,117 +18,121 @@ void linear(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
   dst_grid = cv::Mat::zeros(vs.rows, vs.cols, CV_64FC1);
 
   // Horizontal interpolation
-  for (int i = 0; i < vs.rows; i++) {
-    double* row = src_grid.ptr<double>(i);
-    double* dst_row = dst_grid.ptr<double>(i);
+  parallel_for(0, vs.rows, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      double* row = src_grid.ptr<double>(i);
+      double* dst_row = dst_grid.ptr<double>(i);
 
-    // Left
-    for (int j = 0; j < vs.cols; j++) {
-      if (row[j] <= 1e-9) {
-        continue;
-      }
-      for (int jj = 0; jj <= j; jj++) {
-        dst_row[jj] = row[j];
+      // Left
+      for (int j = 0; j < vs.cols; j++) {
+        if (row[j] <= 1e-9) {
+          continue;
+        }
+        for (int jj = 0; jj <= j; jj++) {
+          dst_row[jj] = row[j];
+        }
+        break;
       }
-      break;
-    }
 
-    // Right
-    for (int j = vs.cols - 1; j >= 0; j--) {
-      if (row[j] <= 1e-9) {
-        continue;
-      }
+      // Right
+      for (int j = vs.cols - 1; j >= 0; j--) {
+        if (row[j] <= 1e-9) {
+          continue;
+        }
 
-      for (int jj = j; jj < vs.cols; jj++) {
-        dst_row[jj] = row[j];
+        for (int jj = j; jj < vs.cols; jj++) {
+          dst_row[jj] = row[j];
+        }
+        break;
       }
-      break;
-    }
 
-    int prev_u = 0;
-    for (int j = 1; j < vs.cols; j++) {
-      if (dst_row[j] <= 1e-9) {
-        continue;
-      }
+      int prev_u = 0;
+      for (int j = 1; j < vs.cols; j++) {
+        if (dst_row[j] <= 1e-9) {
+          continue;
+        }
 
-      double prev_z = dst_row[prev_u];
-      double prev_x =
-          prev_z * (prev_u - env_params.width / 2) / env_params.f_xy;
-      double next_z = dst_row[j];
-      double next_x = next_z * (j - env_params.width / 2) / env_params.f_xy;
-      for (int jj = prev_u; jj <= j; jj++) {
-        double angle = (next_z - prev_z) / (next_x - prev_x);
-        double tan = (jj - env_params.width / 2) / env_params.f_xy;
-        double z = (prev_z - angle * prev_x) / (1 - tan * angle);
-        dst_row[jj] = z;
+        double prev_z = dst_row[prev_u];
+        double prev_x =
+            prev_z * (prev_u - env_params.cx) / env_params.fx;
+        double next_z = dst_row[j];
+        double next_x = next_z * (j - env_params.cx) / env_params.fx;
+        for (int jj = prev_u; jj <= j; jj++) {
+          double angle = (next_z - prev_z) / (next_x - prev_x);
+          double tan = (jj - env_params.cx) / env_params.fx;
+          double z = (prev_z - angle * prev_x) / (1 - tan * angle);
+          dst_row[jj] = z;
+        }
+        prev_u = j;
       }
-      prev_u = j;
     }
-  }
+  });
 
   // Vertical interpolation
-  for (int j = 0; j < vs.cols; j++) {
-    // Up
-    for (int i = 0; i < vs.rows; i++) {
-      double now = dst_grid.at<double>(i, j);
-      if (now <= 1e-9) {
-        continue;
-      }
-      for (int ii = 0; ii <= i; ii++) {
-        dst_grid.at<double>(ii, j) = now;
+  parallel_for(0, vs.cols, [&](int begin, int end) {
+    for (int j = begin; j < end; j++) {
+      // Up
+      for (int i = 0; i < vs.rows; i++) {
+        double now = dst_grid.at<double>(i, j);
+        if (now <= 1e-9) {
+          continue;
+        }
+        for (int ii = 0; ii <= i; ii++) {
+          dst_grid.at<double>(ii, j) = now;
+        }
+        break;
       }
-      break;
-    }
 
-    // Down
-    for (int i = vs.rows - 1; i >= 0; i--) {
-      double now = dst_grid.at<double>(i, j);
-      if (now <= 1e-9) {
-        continue;
-      }
+      // Down
+      for (int i = vs.rows - 1; i >= 0; i--) {
+        double now = dst_grid.at<double>(i, j);
+        if (now <= 1e-9) {
+          continue;
+        }
 
-      for (int ii = i; ii < vs.rows; ii++) {
-        dst_grid.at<double>(ii, j) = now;
+        for (int ii = i; ii < vs.rows; ii++) {
+          dst_grid.at<double>(ii, j) = now;
+        }
+        break;
       }
-      break;
-    }
 
-    int prev_i = 0;
-    for (int i = 1; i < vs.rows; i++) {
-      double now = dst_grid.at<double>(i, j);
-      if (now <= 1e-9) {
-        continue;
-      }
+      int prev_i = 0;
+      for (int i = 1; i < vs.rows; i++) {
+        double now = dst_grid.at<double>(i, j);
+        if (now <= 1e-9) {
+          continue;
+        }
 
-      ushort prev_v = vs.at<ushort>(prev_i, j);
-      ushort next_v = vs.at<ushort>(i, j);
-      if (prev_v >= next_v) {
-        continue;
-      }
+        ushort prev_v = vs.at<ushort>(prev_i, j);
+        ushort next_v = vs.at<ushort>(i, j);
+        if (prev_v >= next_v) {
+          continue;
+        }
 
-      double prev_z = dst_grid.at<double>(prev_i, j);
-      double prev_y =
-          prev_z * (prev_v - env_params.height / 2) / env_params.f_xy;
-      double next_z = now;
-      double next_y =
-          next_z * (next_v - env_params.height / 2) / env_params.f_xy;
-      for (int ii = prev_i; ii <= i; ii++) {
-        ushort now_v = vs.at<ushort>(ii, j);
-        double angle = (next_z - prev_z) / (next_y - prev_y);
-        double tan = (now_v - env_params.height / 2) / env_params.f_xy;
-        double z = (prev_z - angle * prev_y) / (1 - tan * angle);
-        dst_grid.at<double>(ii, j) = z;
+        double prev_z = dst_grid.at<double>(prev_i, j);
+        double prev_y =
+            prev_z * (prev_v - env_params.cy) / env_params.fy;
+        double next_z = now;
+        double next_y =
+            next_z * (next_v - env_params.cy) / env_params.fy;
+        for (int ii = prev_i; ii <= i; ii++) {
+          ushort now_v = vs.at<ushort>(ii, j);
+          double angle = (next_z - prev_z) / (next_y - prev_y);
+          double tan = (now_v - env_params.cy) / env_params.fy;
+          double z = (prev_z - angle * prev_y) / (1 - tan * angle);
+          dst_grid.at<double>(ii, j) = z;
+        }
+        prev_i = i;
       }
-      prev_i = i;
     }
-  }
+  });
 }
 
 cv::Mat generateDiamondKernel(int kernel_size) {
   cv::Mat kernel = cv::Mat::zeros(kernel_size, kernel_size, CV_8UC1);
   int center = kernel_size / 2;
-  kernel.forEach<uchar>(
-      [center, kernel_size](uchar& now, const int position[]) -> void {
+  parallel_for_each<uchar>(
+      kernel, [center, kernel_size](uchar& now, const int position[]) -> void {
         int dist = abs(center - position[0]) + abs(center - position[1]);
 
         if (dist <= center) {
@@ -135,9 +144,16 @@ cv::Mat generateDiamondKernel(int kernel_size) {
 
 void ip_basic(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
               EnvParams env_params) {
+  thread_local IpBasicWorkspace workspace;
+  ip_basic(src_grid, dst_grid, workspace);
+}
+
+void ip_basic_opencv(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+                     EnvParams env_params) {
   double max_dist = 500;
   cv::Mat inverted = cv::Mat::zeros(vs.rows, vs.cols, CV_64FC1);
-  inverted.forEach<double>(
+  parallel_for_each<double>(
+      inverted,
       [&src_grid, &max_dist](double& now, const int position[]) -> void {
         double d = src_grid.at<double>(position[0], position[1]);
         if (d > 0) {
@@ -157,8 +173,8 @@ void ip_basic(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
   cv::Mat full_kernel =
       cv::getStructuringElement(cv::MORPH_RECT, cv::Size(7, 7));
   cv::dilate(closed1, filled1, full_kernel);
-  filled1.forEach<double>(
-      [&closed1](double& now, const int position[]) -> void {
+  parallel_for_each<double>(
+      filled1, [&closed1](double& now, const int position[]) -> void {
         double d = closed1.at<double>(position[0], position[1]);
         if (d > 0) {
           now = d;
@@ -187,8 +203,8 @@ void ip_basic(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
   cv::Mat full_fill_kernel =
       cv::getStructuringElement(cv::MORPH_RECT, cv::Size(31, 31));
   cv::dilate(filled1, filled2, full_fill_kernel);
-  filled2.forEach<double>(
-      [&filled1](double& now, const int position[]) -> void {
+  parallel_for_each<double>(
+      filled2, [&filled1](double& now, const int position[]) -> void {
         double d = filled1.at<double>(position[0], position[1]);
         if (d > 0) {
           now = d;
@@ -196,7 +212,8 @@ void ip_basic(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
       });
 
   dst_grid = cv::Mat::zeros(vs.rows, vs.cols, CV_64FC1);
-  dst_grid.forEach<double>(
+  parallel_for_each<double>(
+      dst_grid,
       [&filled2, &max_dist](double& now, const int position[]) -> void {
         double d = filled2.at<double>(position[0], position[1]);
         if (d > 0) {
@@ -211,8 +228,8 @@ void calc_exist_means(const cv::Mat& mat, cv::Mat& mean_mat, int& r,
   cv::blur(mask_mat, mask_mean, cv::Size(r, r));
 
   cv::blur(mat, mean_mat, cv::Size(r, r));
-  mean_mat.forEach<double>(
-      [&mask_mean, &r](double& now, const int position[]) -> void {
+  parallel_for_each<double>(
+      mean_mat, [&mask_mean, &r](double& now, const int position[]) -> void {
         double mask = mask_mean.at<double>(position[0], position[1]);
         if (mask * r * r > 0.5) {
           now /= mask;
@@ -225,8 +242,8 @@ void calc_exist_means(const cv::Mat& mat, cv::Mat& mean_mat, int& r,
 void guided_filter(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
                    EnvParams env_params, cv::Mat img) {
   cv::Mat gray = cv::Mat::zeros(vs.rows, vs.cols, CV_64FC1);
-  gray.forEach<double>(
-      [&img, &vs, &src_grid](double& now, const int position[]) -> void {
+  parallel_for_each<double>(
+      gray, [&img, &vs, &src_grid](double& now, const int position[]) -> void {
         int v = vs.at<ushort>(position[0], position[1]);
         if (src_grid.at<double>(position[0], position[1]) <= 0) {
           return;
@@ -260,6 +277,12 @@ void guided_filter(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
 
 void mrf(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
          EnvParams env_params, cv::Mat img, double k, double c) {
+  mrf(src_grid, dst_grid, vs, env_params, img, k, c, cv::Mat());
+}
+
+void mrf(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+         EnvParams env_params, cv::Mat img, double k, double c,
+         const cv::Mat& initial_grid) {
   cv::Mat linear_grid;
   linear(src_grid, linear_grid, vs, env_params);
 
@@ -291,10 +314,10 @@ void mrf(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
         int x = j + dx[k];
         int y = i + dy[k];
         if (0 <= x && x < vs.cols && 0 <= y && y < vs.rows) {
-          int v1 = vs.at<double>(y, x);
-          double x_norm2 =
-              cv::norm(img.at<cv::Vec3b>(v0, j) - img.at<cv::Vec3b>(v1, x)) /
-              (255 * 255);
+          int v1 = vs.at<ushort>(y, x);
+          double x_norm2 = color_ssd(img.at<cv::Vec3b>(v0, j),
+                                     img.at<cv::Vec3b>(v1, x)) /
+                           (255.0 * 255);
           double w = -sqrt(exp(-c * x_norm2));
           S_triplets.emplace_back(i * vs.cols + j, y * vs.cols + x, w);
           wSum += w;
@@ -310,142 +333,599 @@ void mrf(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
                            Eigen::Lower | Eigen::Upper>
       cg;
   cg.compute(A);
-  Eigen::VectorXd y_res = cg.solve(b);
+  Eigen::VectorXd y_res;
+  if (initial_grid.empty()) {
+    y_res = cg.solve(b);
+  } else {
+    // 初期値のない点は線形補間の値から始める
+    Eigen::VectorXd guess = z_line;
+    for (int i = 0; i < vs.rows; i++) {
+      for (int j = 0; j < vs.cols; j++) {
+        double val = initial_grid.at<double>(i, j);
+        if (val > 0) {
+          guess[i * vs.cols + j] = val;
+        }
+      }
+    }
+    y_res = cg.solveWithGuess(b, guess);
+  }
 
   dst_grid = cv::Mat::zeros(vs.rows, vs.cols, CV_64FC1);
-  dst_grid.forEach<double>(
-      [&vs, &y_res](double& now, const int position[]) -> void {
+  parallel_for_each<double>(
+      dst_grid, [&vs, &y_res](double& now, const int position[]) -> void {
         now = y_res[position[0] * vs.cols + position[1]];
       });
 }
 
-void pwas(const cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs, cv::Mat& img,
-          double sigma_c, double sigma_s, double sigma_r, double r) {
-  cv::Mat credibilities = cv::Mat::zeros(vs.rows, vs.cols, CV_64FC1);
+void bilateral_solver(const cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+                      cv::Mat& img, double k, double sigma_s,
+                      double sigma_l) {
+  int rows = vs.rows;
+  int cols = vs.cols;
+  int grid_x = (int)ceil((cols - 1) / sigma_s) + 2;
+  int grid_y = (int)ceil((rows - 1) / sigma_s) + 2;
+  int grid_l = (int)ceil(255 / sigma_l) + 2;
 
-  int dx[] = {1, -1, 0, 0};
-  int dy[] = {0, 0, 1, -1};
-  credibilities.forEach<double>([&](double& now, const int position[]) -> void {
-    cv::Vec3b val = 0;
-    int cnt = 0;
-    for (int k = 0; k < 4; k++) {
-      int x = position[1] + dx[k];
-      int y = vs.at<ushort>(position[0] + dy[k], x);
-      if (x < 0 || x >= vs.cols || y < 0 || y >= vs.rows) {
+  // 各画素を囲む8頂点とトライリニアの重み
+  vector<int> corners(rows * cols * 8);
+  vector<double> corner_weights(rows * cols * 8);
+  parallel_for(0, rows, [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      for (int x = 0; x < cols; x++) {
+        cv::Vec3b c = img.at<cv::Vec3b>(vs.at<ushort>(y, x), x);
+        double luma = 0.114 * c[0] + 0.587 * c[1] + 0.299 * c[2];
+        double pos[3] = {x / sigma_s, y / sigma_s, luma / sigma_l};
+        int base[3];
+        double frac[3];
+        for (int d = 0; d < 3; d++) {
+          base[d] = (int)floor(pos[d]);
+          frac[d] = pos[d] - base[d];
+        }
+        int idx = (y * cols + x) * 8;
+        for (int n = 0; n < 8; n++) {
+          int ix = base[0] + (n & 1);
+          int iy = base[1] + (n >> 1 & 1);
+          int il = base[2] + (n >> 2 & 1);
+          corners[idx + n] = (il * grid_y + iy) * grid_x + ix;
+          corner_weights[idx + n] = (n & 1 ? frac[0] : 1 - frac[0]) *
+                                    (n >> 1 & 1 ? frac[1] : 1 - frac[1]) *
+                                    (n >> 2 & 1 ? frac[2] : 1 - frac[2]);
+        }
+      }
+    }
+  });
+
+  // 画素が触れる頂点のみを未知数とする
+  vector<int> vertex_ids(grid_x * grid_y * grid_l, -1);
+  vector<int> vertices;
+  for (int i = 0; i < corners.size(); i++) {
+    int& id = vertex_ids[corners[i]];
+    if (id < 0) {
+      id = vertices.size();
+      vertices.push_back(corners[i]);
+    }
+    corners[i] = id;
+  }
+  int vertex_cnt = vertices.size();
+
+  // データ項: 点のある画素をスプラットした値が深度に近い (重みはmrfと同じk^2)
+  vector<Eigen::Triplet<double>> triplets;
+  Eigen::VectorXd b = Eigen::VectorXd::Zero(vertex_cnt);
+  Eigen::VectorXd guess_sums = Eigen::VectorXd::Zero(vertex_cnt);
+  Eigen::VectorXd guess_weights = Eigen::VectorXd::Zero(vertex_cnt);
+  for (int y = 0; y < rows; y++) {
+    for (int x = 0; x < cols; x++) {
+      double d = src_grid.at<double>(y, x);
+      if (d <= 0) {
+        continue;
+      }
+      int idx = (y * cols + x) * 8;
+      for (int n = 0; n < 8; n++) {
+        double w = corner_weights[idx + n];
+        for (int m = 0; m < 8; m++) {
+          triplets.emplace_back(corners[idx + n], corners[idx + m],
+                                k * k * w * corner_weights[idx + m]);
+        }
+        b[corners[idx + n]] += k * k * w * d;
+        guess_sums[corners[idx + n]] += w * d;
+        guess_weights[corners[idx + n]] += w;
+      }
+    }
+  }
+
+  // 平滑化項: 格子で隣り合う頂点の差 (点のない連結成分は0に固定する)
+  int strides[3] = {1, grid_x, grid_x * grid_y};
+  for (int v = 0; v < vertex_cnt; v++) {
+    triplets.emplace_back(v, v, 1e-6);
+    int cell = vertices[v];
+    int pos[3] = {cell % grid_x, cell / grid_x % grid_y,
+                  cell / grid_x / grid_y};
+    int sizes[3] = {grid_x, grid_y, grid_l};
+    for (int d = 0; d < 3; d++) {
+      if (pos[d] + 1 >= sizes[d]) {
+        continue;
+      }
+      int u = vertex_ids[cell + strides[d]];
+      if (u < 0) {
         continue;
       }
+      triplets.emplace_back(v, v, 1);
+      triplets.emplace_back(u, u, 1);
+      triplets.emplace_back(v, u, -1);
+      triplets.emplace_back(u, v, -1);
+    }
+  }
+
+  Eigen::SparseMatrix<double> A(vertex_cnt, vertex_cnt);
+  A.setFromTriplets(triplets.begin(), triplets.end());
+  Eigen::VectorXd guess = Eigen::VectorXd::Zero(vertex_cnt);
+  for (int v = 0; v < vertex_cnt; v++) {
+    if (guess_weights[v] > 0) {
+      guess[v] = guess_sums[v] / guess_weights[v];
+    }
+  }
+  Eigen::ConjugateGradient<Eigen::SparseMatrix<double>,
+                           Eigen::Lower | Eigen::Upper>
+      cg;
+  cg.compute(A);
+  Eigen::VectorXd solved = cg.solveWithGuess(b, guess);
 
-      val += img.at<cv::Vec3b>(y, x);
-      cnt++;
+  // スライス: 頂点の値をトライリニアに補間する
+  dst_grid = cv::Mat::zeros(rows, cols, CV_64FC1);
+  parallel_for(0, rows, [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      double* row = dst_grid.ptr<double>(y);
+      for (int x = 0; x < cols; x++) {
+        int idx = (y * cols + x) * 8;
+        double val = 0;
+        for (int n = 0; n < 8; n++) {
+          val += corner_weights[idx + n] * solved[corners[idx + n]];
+        }
+        if (val > 0) {
+          row[x] = val;
+        }
+      }
     }
-    val -= cnt * img.at<cv::Vec3b>(vs.at<ushort>(position[0], position[1]),
-                                   position[1]);
-    now = exp(-cv::norm(val) / 2 / sigma_c / sigma_c);
   });
+}
 
-  dst_grid = cv::Mat::zeros(vs.rows, vs.cols, CV_64FC1);
-  dst_grid.forEach<double>([&](double& now, const int position[]) -> void {
-    double coef = 0;
-    double val = 0;
-
-    // すでに点が与えられているならそれを使う
-    double org_val = src_grid.at<double>(position[0], position[1]);
-    if (now > 0) {
-      now = org_val;
-      return;
+vector<cv::Point> pwas_window(double r) {
+  vector<cv::Point> window;
+  for (int ii = 0; ii < r; ii++) {
+    for (int jj = 0; jj < r; jj++) {
+      int dy = ii - r / 2;
+      int dx = jj - r / 2;
+      window.emplace_back(dx, dy);
     }
+  }
+  return window;
+}
 
-    cv::Vec3b d0 =
-        img.at<cv::Vec3b>(vs.at<ushort>(position[0], position[1]), position[1]);
+vector<cv::Point> ext_jbu_window(int r) {
+  vector<cv::Point> window;
+  for (int ii = 0; ii < r; ii++) {
+    for (int jj = 0; jj < r; jj++) {
+      int dy = ii - r / 2;
+      int dx = jj - r / 2;
+      window.emplace_back(dx, dy);
+    }
+  }
+  return window;
+}
 
-    for (int ii = 0; ii < r; ii++) {
-      for (int jj = 0; jj < r; jj++) {
-        int dy = ii - r / 2;
-        int dx = jj - r / 2;
-        int tmp_y = position[0] + dy;
-        int tmp_x = position[1] + dx;
-        if (tmp_y < 0 || tmp_y >= vs.rows || tmp_x < 0 || tmp_x >= vs.cols) {
-          continue;
-        }
+void build_neighbor_index(const cv::Mat& src_grid,
+                          const vector<cv::Point>& window,
+                          NeighborIndex& neighbors) {
+  int rows = src_grid.rows;
+  int cols = src_grid.cols;
+  neighbors.window = window;
+  neighbors.offsets.assign(rows * cols + 1, 0);
 
-        if (src_grid.at<double>(tmp_y, tmp_x) <= 0) {
-          continue;
+  // 画素ごとの有効な点の数を数えてから詰める
+  vector<int> counts(rows * cols, 0);
+  parallel_for(0, rows, [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      for (int x = 0; x < cols; x++) {
+        int cnt = 0;
+        for (int t = 0; t < window.size(); t++) {
+          int tmp_y = y + window[t].y;
+          int tmp_x = x + window[t].x;
+          if (tmp_y < 0 || tmp_y >= rows || tmp_x < 0 || tmp_x >= cols) {
+            continue;
+          }
+          cnt += src_grid.at<double>(tmp_y, tmp_x) > 0;
         }
-
-        cv::Vec3b d1 = img.at<cv::Vec3b>(vs.at<ushort>(tmp_y, tmp_x), tmp_x);
-        double tmp = exp(-(dx * dx + dy * dy) / 2 / sigma_s / sigma_s) *
-                     exp(-cv::norm(d0 - d1) / 2 / sigma_r / sigma_r) *
-                     credibilities.at<double>(tmp_y, tmp_x);
-        val += tmp * src_grid.at<double>(tmp_y, tmp_x);
-        coef += tmp;
+        counts[y * cols + x] = cnt;
       }
     }
-    if (coef > 0) {
-      now = val / coef;
+  });
+  for (int i = 0; i < rows * cols; i++) {
+    neighbors.offsets[i + 1] = neighbors.offsets[i] + counts[i];
+  }
+
+  neighbors.taps.resize(neighbors.offsets.back());
+  neighbors.samples.resize(neighbors.offsets.back());
+  parallel_for(0, rows, [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      for (int x = 0; x < cols; x++) {
+        int n = neighbors.offsets[y * cols + x];
+        for (int t = 0; t < window.size(); t++) {
+          int tmp_y = y + window[t].y;
+          int tmp_x = x + window[t].x;
+          if (tmp_y < 0 || tmp_y >= rows || tmp_x < 0 || tmp_x >= cols) {
+            continue;
+          }
+          if (src_grid.at<double>(tmp_y, tmp_x) <= 0) {
+            continue;
+          }
+          neighbors.taps[n] = t;
+          neighbors.samples[n] = tmp_y * cols + tmp_x;
+          n++;
+        }
+      }
     }
   });
 }
 
-void ext_jbu(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
-             UnionFind& color_segments, EnvParams& vsenv_params,
-             double color_segment_k, double sigma_s, int r, double coef_s) {
-  dst_grid = cv::Mat::zeros(vs.rows, vs.cols, CV_64FC1);
-  dst_grid.forEach<double>([&](double& now, const int position[]) -> void {
-    int y = position[0];
-    int x = position[1];
-    double coef = 0;
-    double val = 0;
-
-    // すでに点が与えられているならそれを使う
-    double src_val = src_grid.at<double>(y, x);
-    if (src_val > 0) {
-      now = src_val;
-      return;
+size_t NeighborIndex::bytes() const {
+  return window.size() * sizeof(cv::Point) + offsets.size() * sizeof(int) +
+         taps.size() * sizeof(int) + samples.size() * sizeof(int);
+}
+
+void pwas(const cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs, cv::Mat& img,
+          double sigma_c, double sigma_s, double sigma_r, double r) {
+  NeighborIndex neighbors;
+  build_neighbor_index(src_grid, pwas_window(r), neighbors);
+  pwas(src_grid, dst_grid, vs, img, sigma_c, sigma_s, sigma_r, neighbors);
+}
+
+void pwas(const cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs, cv::Mat& img,
+          double sigma_c, double sigma_s, double sigma_r,
+          const NeighborIndex& neighbors) {
+  vector<cv::Mat> dst_grids;
+  pwas_batch(src_grid, dst_grids, vs, img, {{sigma_c, sigma_s, sigma_r}},
+             neighbors);
+  dst_grid = dst_grids[0];
+}
+
+void pwas_batch(const cv::Mat& src_grid, vector<cv::Mat>& dst_grids,
+                cv::Mat& vs, cv::Mat& img, const vector<PwasParams>& params,
+                double r) {
+  NeighborIndex neighbors;
+  build_neighbor_index(src_grid, pwas_window(r), neighbors);
+  pwas_batch(src_grid, dst_grids, vs, img, params, neighbors);
+}
+
+void pwas_batch(const cv::Mat& src_grid, vector<cv::Mat>& dst_grids,
+                cv::Mat& vs, cv::Mat& img, const vector<PwasParams>& params,
+                const NeighborIndex& neighbors) {
+  // Colors of the grid
+  cv::Mat colors = cv::Mat::zeros(vs.rows, vs.cols, CV_8UC3);
+  parallel_for_each<cv::Vec3b>(
+      colors, [&](cv::Vec3b& now, const int position[]) -> void {
+        now = img.at<cv::Vec3b>(vs.at<ushort>(position[0], position[1]),
+                                position[1]);
+      });
+
+  // Parameter independent part of the credibilities
+  cv::Mat credibility_norms = cv::Mat::zeros(vs.rows, vs.cols, CV_64FC1);
+  int dx[] = {1, -1, 0, 0};
+  int dy[] = {0, 0, 1, -1};
+  parallel_for_each<double>(
+      credibility_norms, [&](double& now, const int position[]) -> void {
+        // cv::Vec3bでは和と差が飽和するので整数で計算する
+        int val[3] = {0, 0, 0};
+        int cnt = 0;
+        for (int k = 0; k < 4; k++) {
+          int x = position[1] + dx[k];
+          int row = position[0] + dy[k];
+          if (x < 0 || x >= vs.cols || row < 0 || row >= vs.rows) {
+            continue;
+          }
+          int y = vs.at<ushort>(row, x);
+          if (y < 0 || y >= img.rows) {
+            continue;
+          }
+
+          const cv::Vec3b& c = img.at<cv::Vec3b>(y, x);
+          for (int ch = 0; ch < 3; ch++) {
+            val[ch] += c[ch];
+          }
+          cnt++;
+        }
+        const cv::Vec3b& center =
+            colors.at<cv::Vec3b>(position[0], position[1]);
+        double sum = 0;
+        for (int ch = 0; ch < 3; ch++) {
+          int d = val[ch] - cnt * center[ch];
+          sum += (double)d * d;
+        }
+        now = sqrt(sum);
+      });
+
+  // sigma_cごとの信頼度
+  map<double, cv::Mat> credibilities;
+  for (int k = 0; k < params.size(); k++) {
+    double sigma_c = params[k].sigma_c;
+    if (credibilities.count(sigma_c)) {
+      continue;
     }
+    cv::Mat credibility = cv::Mat::zeros(vs.rows, vs.cols, CV_64FC1);
+    parallel_for_each<double>(
+        credibility, [&](double& now, const int position[]) -> void {
+          now = exp(-credibility_norms.at<double>(position[0], position[1]) /
+                    2 / sigma_c / sigma_c);
+        });
+    credibilities[sigma_c] = credibility;
+  }
+  vector<const double*> param_credibilities;
+  for (int k = 0; k < params.size(); k++) {
+    param_credibilities.push_back(
+        credibilities[params[k].sigma_c].ptr<double>());
+  }
+
+  // sigma_rごとの色の重みの表 (呼び出しをまたいで使い回す)
+  vector<shared_ptr<const ColorWeightLut>> param_color_luts;
+  for (int k = 0; k < params.size(); k++) {
+    param_color_luts.push_back(ColorWeightLut::shared(params[k].sigma_r));
+  }
 
-    int v = vs.at<ushort>(y, x);
-    int r0 = color_segments.root(v * vsenv_params.width + x);
+  // Spatial weights for each parameter and offset
+  const vector<cv::Point>& window = neighbors.window;
+  int tap_cnt = window.size();
+  vector<double> spatial_weights(params.size() * tap_cnt);
+  for (int k = 0; k < params.size(); k++) {
+    double sigma_s = params[k].sigma_s;
+    for (int t = 0; t < tap_cnt; t++) {
+      int dx = window[t].x;
+      int dy = window[t].y;
+      spatial_weights[k * tap_cnt + t] =
+          exp(-(dx * dx + dy * dy) / 2 / sigma_s / sigma_s);
+    }
+  }
+
+  dst_grids.resize(params.size());
+  for (int k = 0; k < params.size(); k++) {
+    dst_grids[k] = cv::Mat::zeros(vs.rows, vs.cols, CV_64FC1);
+  }
 
-    for (int ii = 0; ii < r; ii++) {
-      for (int jj = 0; jj < r; jj++) {
-        int dy = ii - r / 2;
-        int dx = jj - r / 2;
-        if (y + dy < 0 || y + dy >= vs.rows || x + dx < 0 ||
-            x + dx >= vs.cols) {
+  const cv::Vec3b* color_data = colors.ptr<cv::Vec3b>();
+  const double* depth_data = src_grid.ptr<double>();
+  parallel_for(0, vs.rows, [&](int y_begin, int y_end) {
+    vector<int> color_ssds;
+    for (int y = y_begin; y < y_end; y++) {
+      for (int x = 0; x < vs.cols; x++) {
+        int idx = y * vs.cols + x;
+        int begin = neighbors.offsets[idx];
+        int end = neighbors.offsets[idx + 1];
+        if (begin == end) {
           continue;
         }
 
-        double neighbor_val = src_grid.at<double>(y + dy, x + dx);
-        if (neighbor_val <= 0) {
-          continue;
+        color_ssds.resize(end - begin);
+        color_ssd_taps(color_data[idx], color_data,
+                       &neighbors.samples[begin], end - begin,
+                       color_ssds.data());
+
+        for (int k = 0; k < params.size(); k++) {
+          const ColorWeightLut& color_weights = *param_color_luts[k];
+          const double* spatial = &spatial_weights[k * tap_cnt];
+          const double* credibility = param_credibilities[k];
+          double coef = 0;
+          double val = 0;
+          for (int n = begin; n < end; n++) {
+            int sample = neighbors.samples[n];
+            double tmp = spatial[neighbors.taps[n]] *
+                         color_weights[color_ssds[n - begin]] *
+                         credibility[sample];
+            val += tmp * depth_data[sample];
+            coef += tmp;
+          }
+          if (coef > 0) {
+            dst_grids[k].at<double>(y, x) = val / coef;
+          }
         }
+      }
+    }
+  });
+}
+
+namespace {
+// 1次元の再帰フィルタを両方向にかける (distances[i]はi - 1とiの間の距離)
+void recursive_filter(double* weighted, double* weights, int step,
+                      const double* distances, int dist_step, int n,
+                      double a) {
+  for (int i = 1; i < n; i++) {
+    double w = pow(a, distances[i * dist_step]);
+    weighted[i * step] += w * (weighted[(i - 1) * step] - weighted[i * step]);
+    weights[i * step] += w * (weights[(i - 1) * step] - weights[i * step]);
+  }
+  for (int i = n - 2; i >= 0; i--) {
+    double w = pow(a, distances[(i + 1) * dist_step]);
+    weighted[i * step] += w * (weighted[(i + 1) * step] - weighted[i * step]);
+    weights[i * step] += w * (weights[(i + 1) * step] - weights[i * step]);
+  }
+}
+}  // namespace
+
+void domain_transform(const cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+                      cv::Mat& img, double sigma_s, double sigma_r,
+                      int iterations) {
+  int rows = vs.rows;
+  int cols = vs.cols;
+  cv::Mat colors = cv::Mat::zeros(rows, cols, CV_8UC3);
+  parallel_for_each<cv::Vec3b>(
+      colors, [&](cv::Vec3b& now, const int position[]) -> void {
+        now = img.at<cv::Vec3b>(vs.at<ushort>(position[0], position[1]),
+                                position[1]);
+      });
 
-        int v1 = vs.at<ushort>(y + dy, x + dx);
-        int r1 = color_segments.root(v1 * vsenv_params.width + x + dx);
-        double tmp = exp(-(dx * dx + dy * dy) / 2 / sigma_s / sigma_s);
-        if (r1 != r0) {
-          tmp *= coef_s;
+  // 変換後の隣接画素間の距離 (横: x - 1とx，縦: y - 1とy)
+  double ratio = sigma_s / sigma_r;
+  cv::Mat dist_x = cv::Mat::ones(rows, cols, CV_64FC1);
+  cv::Mat dist_y = cv::Mat::ones(rows, cols, CV_64FC1);
+  parallel_for(0, rows, [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      const cv::Vec3b* color_row = colors.ptr<cv::Vec3b>(y);
+      double* dx_row = dist_x.ptr<double>(y);
+      double* dy_row = dist_y.ptr<double>(y);
+      for (int x = 0; x < cols; x++) {
+        if (x > 0) {
+          dx_row[x] += ratio * color_sad(color_row[x], color_row[x - 1]);
+        }
+        if (y > 0) {
+          dy_row[x] +=
+              ratio * color_sad(color_row[x], colors.at<cv::Vec3b>(y - 1, x));
         }
-        val += tmp * neighbor_val;
-        coef += tmp;
       }
     }
+  });
+
+  // 正規化畳み込み: 深度 * マスクとマスクを同じフィルタにかけて割る
+  cv::Mat weighted = cv::Mat::zeros(rows, cols, CV_64FC1);
+  cv::Mat weights = cv::Mat::zeros(rows, cols, CV_64FC1);
+  src_grid.copyTo(weighted, src_grid > 0);
+  weights.setTo(1, src_grid > 0);
+
+  int step = weighted.step[0] / sizeof(double);
+  int dist_step = dist_y.step[0] / sizeof(double);
+  for (int i = 0; i < iterations; i++) {
+    // 反復ごとに空間の標準偏差を小さくし，合計がsigma_sになるようにする
+    double sigma_i = sigma_s * sqrt(3) * pow(2, iterations - i - 1) /
+                     sqrt(pow(4, iterations) - 1);
+    double a = exp(-sqrt(2) / sigma_i);
+
+    parallel_for(0, rows, [&](int begin, int end) {
+      for (int y = begin; y < end; y++) {
+        recursive_filter(weighted.ptr<double>(y), weights.ptr<double>(y), 1,
+                         dist_x.ptr<double>(y), 1, cols, a);
+      }
+    });
+    parallel_for(0, cols, [&](int begin, int end) {
+      for (int x = begin; x < end; x++) {
+        recursive_filter(weighted.ptr<double>() + x, weights.ptr<double>() + x,
+                         step, dist_y.ptr<double>() + x, dist_step, rows, a);
+      }
+    });
+  }
+
+  dst_grid = cv::Mat::zeros(rows, cols, CV_64FC1);
+  parallel_for_each<double>(
+      dst_grid, [&](double& now, const int position[]) -> void {
+        double w = weights.at<double>(position[0], position[1]);
+        if (w > 1e-9) {
+          now = weighted.at<double>(position[0], position[1]) / w;
+        }
+      });
+}
+
+// segments: Segment of each grid point
+void ext_jbu_segments(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+                      const cv::Mat& segments, double sigma_s,
+                      const NeighborIndex& neighbors, double coef_s) {
+  const vector<cv::Point>& window = neighbors.window;
+  vector<double> spatial_weights(window.size());
+  for (int t = 0; t < window.size(); t++) {
+    int dx = window[t].x;
+    int dy = window[t].y;
+    spatial_weights[t] = exp(-(dx * dx + dy * dy) / 2 / sigma_s / sigma_s);
+  }
+
+  const int* segment_data = segments.ptr<int>();
+  const double* depth_data = src_grid.ptr<double>();
+  dst_grid = cv::Mat::zeros(vs.rows, vs.cols, CV_64FC1);
+  parallel_for_each<double>(
+      dst_grid, [&](double& now, const int position[]) -> void {
+        int y = position[0];
+        int x = position[1];
+        double coef = 0;
+        double val = 0;
+
+        // すでに点が与えられているならそれを使う
+        double src_val = src_grid.at<double>(y, x);
+        if (src_val > 0) {
+          now = src_val;
+          return;
+        }
+
+        int idx = y * vs.cols + x;
+        int r0 = segment_data[idx];
+        for (int n = neighbors.offsets[idx]; n < neighbors.offsets[idx + 1];
+             n++) {
+          int sample = neighbors.samples[n];
+          double tmp = spatial_weights[neighbors.taps[n]];
+          if (segment_data[sample] != r0) {
+            tmp *= coef_s;
+          }
+          val += tmp * depth_data[sample];
+          coef += tmp;
+        }
+
+        /* Bigger threshold will remove noises */
+        if (coef > 1e-9) {
+          now = val / coef;
+        }
+      });
+}
+
+void ext_jbu(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+             UnionFind& color_segments, EnvParams& vsenv_params,
+             double color_segment_k, double sigma_s,
+             const NeighborIndex& neighbors, double coef_s) {
+  // Segment of each grid point
+  // (rootは経路圧縮で書き換えるので並列処理の前に求める)
+  cv::Mat segments = cv::Mat::zeros(vs.rows, vs.cols, CV_32SC1);
+  for (int y = 0; y < vs.rows; y++) {
+    for (int x = 0; x < vs.cols; x++) {
+      int v = vs.at<ushort>(y, x);
+      segments.at<int>(y, x) = color_segments.root(v * vsenv_params.width + x);
+    }
+  }
+  ext_jbu_segments(src_grid, dst_grid, vs, segments, sigma_s, neighbors,
+                   coef_s);
+}
 
-    /* Bigger threshold will remove noises */
-    if (coef > 1e-9) {
-      now = val / coef;
+void segment_labels(cv::Mat& img, double color_segment_k, cv::Mat& labels) {
+  SegmentationGraph graph(&img);
+  shared_ptr<UnionFind> color_segments = graph.segmentate(color_segment_k);
+  labels = cv::Mat::zeros(img.rows, img.cols, CV_32SC1);
+  for (int y = 0; y < img.rows; y++) {
+    int* row = labels.ptr<int>(y);
+    for (int x = 0; x < img.cols; x++) {
+      row[x] = color_segments->root(y * img.cols + x);
     }
+  }
+}
+
+void ext_jbu(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+             const cv::Mat& labels, double sigma_s,
+             const NeighborIndex& neighbors, double coef_s) {
+  cv::Mat segments = cv::Mat::zeros(vs.rows, vs.cols, CV_32SC1);
+  parallel_for_each<int>(segments, [&](int& now, const int position[]) -> void {
+    int v = vs.at<ushort>(position[0], position[1]);
+    now = labels.at<int>(v, position[1]);
   });
+  ext_jbu_segments(src_grid, dst_grid, vs, segments, sigma_s, neighbors,
+                   coef_s);
 }
 
 void original(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
               EnvParams& env_params, cv::Mat& img, double color_segment_k,
               double sigma_s, int r, double coef_s) {
+  NeighborIndex neighbors;
+  build_neighbor_index(src_grid, ext_jbu_window(r), neighbors);
+  original(src_grid, dst_grid, vs, env_params, img, color_segment_k, sigma_s,
+           neighbors, coef_s);
+}
+
+void original(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+              EnvParams& env_params, cv::Mat& img, double color_segment_k,
+              double sigma_s, const NeighborIndex& neighbors, double coef_s) {
   shared_ptr<UnionFind> color_segments;
   SegmentationGraph graph(&img);
   color_segments = graph.segmentate(color_segment_k);
   ext_jbu(src_grid, dst_grid, vs, *color_segments, env_params, color_segment_k,
-          sigma_s, r, coef_s);
+          sigma_s, neighbors, coef_s);
 
   // 必要に応じて複数回実行
   /*
@@ -459,7 +939,8 @@ void original(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
   /*
   double max_dist = 500;
   cv::Mat inverted = cv::Mat::zeros(vs.rows, vs.cols, CV_64FC1);
-  inverted.forEach<double>(
+  parallel_for_each<double>(
+      inverted,
       [&dst_grid, &max_dist](double& now, const int position[]) -> void {
         double d = dst_grid.at<double>(position[0], position[1]);
         if (d > 0) {
@@ -474,14 +955,16 @@ void original(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
   cv::Mat full_fill_kernel =
       cv::getStructuringElement(cv::MORPH_RECT, cv::Size(31, 31));
   cv::dilate(filled, filled2, full_fill_kernel);
-  filled2.forEach<double>([&filled](double& now, const int position[]) -> void {
-    double d = filled.at<double>(position[0], position[1]);
-    if (d > 0) {
-      now = d;
-    }
-  });
+  parallel_for_each<double>(
+      filled2, [&filled](double& now, const int position[]) -> void {
+        double d = filled.at<double>(position[0], position[1]);
+        if (d > 0) {
+          now = d;
+        }
+      });
 
-  dst_grid.forEach<double>(
+  parallel_for_each<double>(
+      dst_grid,
       [&filled2, &max_dist](double& now, const int position[]) -> void {
         double d = filled2.at<double>(position[0], position[1]);
         if (d > 0) {
@@ -489,4 +972,246 @@ void original(cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
         }
       });
   */
-}
\ No newline at end of file
+}
+namespace {
+// One level of the pyramid
+struct PyramidLevel {
+  // Mean depth of the valid points (0: no point)
+  cv::Mat depth;
+  // Mean color of the cells (CV_64FC3)
+  cv::Mat color;
+};
+
+// 2x2のセルを1つにまとめる (深度は有効な点のみの平均)
+void reduce_level(const PyramidLevel& fine, PyramidLevel& coarse) {
+  int rows = (fine.depth.rows + 1) / 2;
+  int cols = (fine.depth.cols + 1) / 2;
+  coarse.depth = cv::Mat::zeros(rows, cols, CV_64FC1);
+  coarse.color = cv::Mat::zeros(rows, cols, CV_64FC3);
+  parallel_for(0, rows, [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      for (int x = 0; x < cols; x++) {
+        double depth_sum = 0;
+        int depth_cnt = 0;
+        cv::Vec3d color_sum = 0;
+        int color_cnt = 0;
+        for (int dy = 0; dy < 2; dy++) {
+          for (int dx = 0; dx < 2; dx++) {
+            int fy = 2 * y + dy;
+            int fx = 2 * x + dx;
+            if (fy >= fine.depth.rows || fx >= fine.depth.cols) {
+              continue;
+            }
+            double d = fine.depth.at<double>(fy, fx);
+            if (d > 0) {
+              depth_sum += d;
+              depth_cnt++;
+            }
+            color_sum += fine.color.at<cv::Vec3d>(fy, fx);
+            color_cnt++;
+          }
+        }
+        if (depth_cnt > 0) {
+          coarse.depth.at<double>(y, x) = depth_sum / depth_cnt;
+        }
+        coarse.color.at<cv::Vec3d>(y, x) = color_sum / color_cnt;
+      }
+    }
+  });
+}
+
+/*
+Fill the holes of the fine level from the result of the coarse level
+穴の画素は，細かいレベルの3x3の有効な点と粗いレベルの3x3の結果(アップサンプリング)の
+同時バイラテラル重み付き平均とする
+*/
+void expand_level(const PyramidLevel& fine, const PyramidLevel& coarse,
+                  const cv::Mat& coarse_result, double sigma_s, double sigma_r,
+                  cv::Mat& result) {
+  int rows = fine.depth.rows;
+  int cols = fine.depth.cols;
+  result = fine.depth.clone();
+  parallel_for(0, rows, [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      for (int x = 0; x < cols; x++) {
+        if (fine.depth.at<double>(y, x) > 0) {
+          continue;
+        }
+
+        const cv::Vec3d& c0 = fine.color.at<cv::Vec3d>(y, x);
+        double val = 0;
+        double coef = 0;
+        for (int dy = -1; dy <= 1; dy++) {
+          for (int dx = -1; dx <= 1; dx++) {
+            int ty = y + dy;
+            int tx = x + dx;
+            if (ty < 0 || ty >= rows || tx < 0 || tx >= cols) {
+              continue;
+            }
+            double d = fine.depth.at<double>(ty, tx);
+            if (d <= 0) {
+              continue;
+            }
+            double w = exp(-(dx * dx + dy * dy) / 2.0 / sigma_s / sigma_s) *
+                       exp(-cv::norm(c0 - fine.color.at<cv::Vec3d>(ty, tx)) /
+                           2 / sigma_r / sigma_r);
+            val += w * d;
+            coef += w;
+          }
+        }
+
+        // 粗いセルの中心までの距離は細かいレベルの単位で測る
+        for (int cy = y / 2 - 1; cy <= y / 2 + 1; cy++) {
+          for (int cx = x / 2 - 1; cx <= x / 2 + 1; cx++) {
+            if (cy < 0 || cy >= coarse_result.rows || cx < 0 ||
+                cx >= coarse_result.cols) {
+              continue;
+            }
+            double d = coarse_result.at<double>(cy, cx);
+            if (d <= 0) {
+              continue;
+            }
+            double sy = 2 * cy + 0.5 - y;
+            double sx = 2 * cx + 0.5 - x;
+            double w =
+                exp(-(sx * sx + sy * sy) / 2 / sigma_s / sigma_s) *
+                exp(-cv::norm(c0 - coarse.color.at<cv::Vec3d>(cy, cx)) / 2 /
+                    sigma_r / sigma_r);
+            val += w * d;
+            coef += w;
+          }
+        }
+
+        if (coef > 1e-9) {
+          result.at<double>(y, x) = val / coef;
+        }
+      }
+    }
+  });
+}
+}  // namespace
+
+void pyramid(const cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+             cv::Mat& img, double sigma_s, double sigma_r, int max_levels) {
+  vector<PyramidLevel> levels(1);
+  levels[0].depth = src_grid.clone();
+  levels[0].color = cv::Mat::zeros(vs.rows, vs.cols, CV_64FC3);
+  parallel_for_each<cv::Vec3d>(
+      levels[0].color, [&](cv::Vec3d& now, const int position[]) -> void {
+        now = img.at<cv::Vec3b>(vs.at<ushort>(position[0], position[1]),
+                                position[1]);
+      });
+
+  // 穴がなくなるか十分に小さくなるまで粗くする
+  while (levels.size() < max_levels && levels.back().depth.rows > 2 &&
+         levels.back().depth.cols > 2 &&
+         cv::countNonZero(levels.back().depth > 0) <
+             levels.back().depth.total()) {
+    PyramidLevel coarse;
+    reduce_level(levels.back(), coarse);
+    levels.push_back(coarse);
+  }
+
+  // 最も粗いレベルで補完する．残った穴はそのレベルの色を案内として
+  // domain transformで埋め，点のあるセルはそのまま使う
+  const PyramidLevel& top = levels.back();
+  cv::Mat result = top.depth.clone();
+  if (cv::countNonZero(top.depth > 0) < top.depth.total()) {
+    cv::Mat top_vs(top.depth.rows, top.depth.cols, CV_16SC1);
+    parallel_for_each<ushort>(
+        top_vs,
+        [](ushort& now, const int position[]) -> void { now = position[0]; });
+    cv::Mat top_img;
+    top.color.convertTo(top_img, CV_8UC3);
+    cv::Mat filled;
+    domain_transform(top.depth, filled, top_vs, top_img,
+                     max(top.depth.rows, top.depth.cols), sigma_r, 3);
+    filled.copyTo(result, top.depth <= 0);
+  }
+
+  for (int l = levels.size() - 2; l >= 0; l--) {
+    cv::Mat finer;
+    expand_level(levels[l], levels[l + 1], result, sigma_s, sigma_r, finer);
+    result = finer;
+  }
+  dst_grid = result;
+}
+
+namespace {
+const vector<pair<string, InterpolationMethod>>& method_registry() {
+  static const vector<pair<string, InterpolationMethod>> registry = {
+      {"linear",
+       [](cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+          EnvParams& env_params, cv::Mat& img, HyperParams& hyper_params) {
+         linear(src_grid, dst_grid, vs, env_params);
+       }},
+      {"ip-basic",
+       [](cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+          EnvParams& env_params, cv::Mat& img, HyperParams& hyper_params) {
+         ip_basic(src_grid, dst_grid, vs, env_params);
+       }},
+      {"guided-filter",
+       [](cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+          EnvParams& env_params, cv::Mat& img, HyperParams& hyper_params) {
+         guided_filter(src_grid, dst_grid, vs, env_params, img);
+       }},
+      {"mrf",
+       [](cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+          EnvParams& env_params, cv::Mat& img, HyperParams& hyper_params) {
+         mrf(src_grid, dst_grid, vs, env_params, img, hyper_params.mrf_k,
+             hyper_params.mrf_c);
+       }},
+      {"bilateral-solver",
+       [](cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+          EnvParams& env_params, cv::Mat& img, HyperParams& hyper_params) {
+         bilateral_solver(src_grid, dst_grid, vs, img, hyper_params.mrf_k,
+                          hyper_params.bs_sigma_s, hyper_params.bs_sigma_l);
+       }},
+      {"pwas",
+       [](cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+          EnvParams& env_params, cv::Mat& img, HyperParams& hyper_params) {
+         pwas(src_grid, dst_grid, vs, img, hyper_params.pwas_sigma_c,
+              hyper_params.pwas_sigma_s, hyper_params.pwas_sigma_r,
+              hyper_params.pwas_r);
+       }},
+      {"domain-transform",
+       [](cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+          EnvParams& env_params, cv::Mat& img, HyperParams& hyper_params) {
+         domain_transform(src_grid, dst_grid, vs, img, hyper_params.dt_sigma_s,
+                          hyper_params.dt_sigma_r, hyper_params.dt_iterations);
+       }},
+      {"original",
+       [](cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+          EnvParams& env_params, cv::Mat& img, HyperParams& hyper_params) {
+         original(src_grid, dst_grid, vs, env_params, img,
+                  hyper_params.original_color_segment_k,
+                  hyper_params.original_sigma_s, hyper_params.original_r,
+                  hyper_params.original_coef_s);
+       }},
+      {"pyramid",
+       [](cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs,
+          EnvParams& env_params, cv::Mat& img, HyperParams& hyper_params) {
+         pyramid(src_grid, dst_grid, vs, img, hyper_params.pyramid_sigma_s,
+                 hyper_params.pyramid_sigma_r);
+       }},
+  };
+  return registry;
+}
+}  // namespace
+
+vector<string> method_names() {
+  vector<string> names;
+  for (const auto& entry : method_registry()) {
+    names.push_back(entry.first);
+  }
+  return names;
+}
+
+const InterpolationMethod* find_method(const string& name) {
+  for (const auto& entry : method_registry()) {
+    if (entry.first == name) {
+      return &entry.second;
+    }
+  }
+  return nullptr;
+}
@@ -1,49 +1,369 @@
-#include <map>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
 
+#include <sys/stat.h>
+#include <opencv2/opencv.hpp>
+
+#include "lidar.h"
 #include "models.h"
 
 using namespace std;
 
-EnvParams load_env_params(string params_name) {
-  map<string, EnvParams> params;
+#ifndef PROFILES_PATH
+#define PROFILES_PATH "config/profiles.yaml"
+#endif
+
+namespace {
+template <typename T>
+void read_value(const cv::FileNode& node, const string& key, T& value) {
+  cv::FileNode child = node[key];
+  if (child.empty() || (!child.isReal() && !child.isInt())) {
+    throw runtime_error("Missing or non-numeric '" + key + "'");
+  }
+  value = (T)(double)child;
+}
+
+// キーがあれば上書きする
+template <typename T>
+void read_optional(const cv::FileNode& node, const string& key, T& value) {
+  if (!node[key].empty()) {
+    read_value(node, key, value);
+  }
+}
+
+void read_hyper_params(const cv::FileNode& node, HyperParams& params) {
+  if (node.empty()) {
+    return;
+  }
+  read_optional(node, "mrf_k", params.mrf_k);
+  read_optional(node, "mrf_c", params.mrf_c);
+  read_optional(node, "bs_sigma_s", params.bs_sigma_s);
+  read_optional(node, "bs_sigma_l", params.bs_sigma_l);
+  read_optional(node, "pwas_sigma_c", params.pwas_sigma_c);
+  read_optional(node, "pwas_sigma_s", params.pwas_sigma_s);
+  read_optional(node, "pwas_sigma_r", params.pwas_sigma_r);
+  read_optional(node, "pwas_r", params.pwas_r);
+  read_optional(node, "dt_sigma_s", params.dt_sigma_s);
+  read_optional(node, "dt_sigma_r", params.dt_sigma_r);
+  read_optional(node, "dt_iterations", params.dt_iterations);
+  read_optional(node, "original_color_segment_k",
+                params.original_color_segment_k);
+  read_optional(node, "original_sigma_s", params.original_sigma_s);
+  read_optional(node, "original_r", params.original_r);
+  read_optional(node, "original_coef_s", params.original_coef_s);
+  read_optional(node, "pyramid_sigma_s", params.pyramid_sigma_s);
+  read_optional(node, "pyramid_sigma_r", params.pyramid_sigma_r);
+}
+
+shared_ptr<const LidarModel> read_lidar(const cv::FileNode& entry,
+                                        const string& name) {
+  cv::FileNode elevations = entry["elevations"];
+  if (!elevations.empty()) {
+    if (!elevations.isSeq()) {
+      throw runtime_error("'elevations' must be a sequence");
+    }
+    vector<double> degrees;
+    for (int i = 0; i < elevations.size(); i++) {
+      degrees.push_back((double)elevations[i]);
+    }
+    return make_shared<LidarModel>(LidarModel::from_elevations(name, degrees));
+  }
+
+  // 等間隔のビーム．atan2(y, r)の範囲は仰角の符号を反転したもの
+  int layers;
+  double min_elevation, max_elevation;
+  read_value(entry, "layers", layers);
+  read_value(entry, "min_elevation", min_elevation);
+  read_value(entry, "max_elevation", max_elevation);
+  string ring_order = (string)entry["ring_order"];
+  if (!ring_order.empty() && ring_order != "ascending" &&
+      ring_order != "descending") {
+    throw runtime_error("'ring_order' must be ascending or descending");
+  }
+  return make_shared<LidarModel>(
+      LidarModel::uniform(name, layers, -max_elevation, -min_elevation,
+                          ring_order != "descending"));
+}
 
-  params["miyanosawa_20200303_rgb"] = {640, 480, 640, 506, 483,
-                                       495, 568, 551, 510, false};
-  params["miyanosawa_20200303_thermal"] = {
-      938, 606, 938 / 2 * 1.01, 495, 466, 450, 469, 503, 487, false};
+/*
+Modified time and size of a file
+秒単位の時刻では1秒以内の更新を見逃すので，ナノ秒の時刻とサイズも比べる
+*/
+struct FileStamp {
+  time_t sec = 0;
+  long nsec = 0;
+  off_t size = -1;
 
-  params["miyanosawa_20200204_rgb"] = {640, 480, 640, 506, 483,
-                                       495, 568, 551, 510, false};
-  params["miyanosawa_20200204_thermal"] = {
-      938, 606, 938 / 2 * 1.01, 495, 475, 458, 488, 568, 500, false};
+  bool operator==(const FileStamp& other) const {
+    return sec == other.sec && nsec == other.nsec && size == other.size;
+  }
+};
+
+mutex registry_mutex;
+string registry_path = "";
+shared_ptr<const ProfileRegistry> registry;
+FileStamp registry_stamp;
 
-  params["13jo_20200219_rgb"] = {672, 376, 672 / 2, 504, 474,
-                                 493, 457, 489,     512, false};
-  params["13jo_20200219_thermal"] = {
-      938, 606, 938 / 2 * 1.01, 502, 484, 499, 478, 520, 502, false};
+string current_path() {
+  if (!registry_path.empty()) {
+    return registry_path;
+  }
+  const char* env = getenv("POINT_INTERPOLATION_PROFILES");
+  return env != nullptr ? env : PROFILES_PATH;
+}
 
-  params["hassamu_20201203_rgb"] = {640, 480, 640, 489, 492,
-                                    510, 571, 529, 501, false};
-  params["hassamu_20201203_thermal"] = {
-      938, 606, 938 / 2 * 1.01, 486, 483, 448, 491, 472, 495, false};
+FileStamp file_stamp(const string& path) {
+  FileStamp stamp;
+  struct stat st;
+  if (stat(path.c_str(), &st) == 0) {
+    stamp.sec = st.st_mtim.tv_sec;
+    stamp.nsec = st.st_mtim.tv_nsec;
+    stamp.size = st.st_size;
+  }
+  return stamp;
+}
+}  // namespace
 
-  if (params.count(params_name)) {
-    return params[params_name];
-  } else {
-    return params["miyanosawa_20200303_rgb"];
+bool has_distortion(const EnvParams& env_params) {
+  for (int i = 0; i < 5; i++) {
+    if (env_params.distortion[i] != 0) {
+      return true;
+    }
   }
+  return false;
+}
+
+Eigen::Matrix4d calibration_matrix(const EnvParams& env_params) {
+  double rollVal = (env_params.roll - 500) / 1000.0;
+  double pitchVal = (env_params.pitch - 500) / 1000.0;
+  double yawVal = (env_params.yaw - 500) / 1000.0;
+  Eigen::Matrix4d calibration_mtx;
+  calibration_mtx << cos(yawVal) * cos(pitchVal),
+      cos(yawVal) * sin(pitchVal) * sin(rollVal) - sin(yawVal) * cos(rollVal),
+      cos(yawVal) * sin(pitchVal) * cos(rollVal) + sin(yawVal) * sin(rollVal),
+      (env_params.X - 500) / 100.0, sin(yawVal) * cos(pitchVal),
+      sin(yawVal) * sin(pitchVal) * sin(rollVal) + cos(yawVal) * cos(rollVal),
+      sin(yawVal) * sin(pitchVal) * cos(rollVal) - cos(yawVal) * sin(rollVal),
+      (env_params.Y - 500) / 100.0, -sin(pitchVal),
+      cos(pitchVal) * sin(rollVal), cos(pitchVal) * cos(rollVal),
+      (env_params.Z - 500) / 100.0, 0, 0, 0, 1;
+  return calibration_mtx;
+}
+
+shared_ptr<const ProfileRegistry> ProfileRegistry::load(const string& path) {
+  cv::FileStorage fs;
+  try {
+    fs.open(path, cv::FileStorage::READ);
+  } catch (const cv::Exception& e) {
+    throw runtime_error(path + ": " + e.what());
+  }
+  if (!fs.isOpened()) {
+    throw runtime_error(path + ": Cannot open the profile file");
+  }
+
+  auto loaded = make_shared<ProfileRegistry>();
+  try {
+    cv::FileNode defaults = fs["default_hyper_params"];
+    if (defaults.empty()) {
+      throw runtime_error("Missing 'default_hyper_params'");
+    }
+    HyperParams& hyper = loaded->default_hyper_params;
+    read_value(defaults, "mrf_k", hyper.mrf_k);
+    read_value(defaults, "mrf_c", hyper.mrf_c);
+    read_value(defaults, "bs_sigma_s", hyper.bs_sigma_s);
+    read_value(defaults, "bs_sigma_l", hyper.bs_sigma_l);
+    read_value(defaults, "pwas_sigma_c", hyper.pwas_sigma_c);
+    read_value(defaults, "pwas_sigma_s", hyper.pwas_sigma_s);
+    read_value(defaults, "pwas_sigma_r", hyper.pwas_sigma_r);
+    read_value(defaults, "pwas_r", hyper.pwas_r);
+    read_value(defaults, "dt_sigma_s", hyper.dt_sigma_s);
+    read_value(defaults, "dt_sigma_r", hyper.dt_sigma_r);
+    read_value(defaults, "dt_iterations", hyper.dt_iterations);
+    read_value(defaults, "original_color_segment_k",
+               hyper.original_color_segment_k);
+    read_value(defaults, "original_sigma_s", hyper.original_sigma_s);
+    read_value(defaults, "original_r", hyper.original_r);
+    read_value(defaults, "original_coef_s", hyper.original_coef_s);
+    read_value(defaults, "pyramid_sigma_s", hyper.pyramid_sigma_s);
+    read_value(defaults, "pyramid_sigma_r", hyper.pyramid_sigma_r);
+
+    cv::FileNode lidar_entries = fs["lidars"];
+    if (!lidar_entries.empty() && !lidar_entries.isSeq()) {
+      throw runtime_error("'lidars' must be a sequence");
+    }
+    for (auto it = lidar_entries.begin(); it != lidar_entries.end(); ++it) {
+      string name = (string)(*it)["name"];
+      if (name.empty()) {
+        throw runtime_error("A LiDAR without 'name'");
+      }
+      if (loaded->lidars.count(name)) {
+        throw runtime_error("Duplicated LiDAR '" + name + "'");
+      }
+      try {
+        loaded->lidars[name] = read_lidar(*it, name);
+      } catch (const runtime_error& e) {
+        throw runtime_error("LiDAR '" + name + "': " + e.what());
+      }
+    }
+
+    cv::FileNode entries = fs["profiles"];
+    if (!entries.isSeq()) {
+      throw runtime_error("'profiles' must be a sequence");
+    }
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+      cv::FileNode entry = *it;
+      Profile profile;
+      profile.name = (string)entry["name"];
+      if (profile.name.empty()) {
+        throw runtime_error("A profile without 'name'");
+      }
+      if (loaded->profiles.count(profile.name)) {
+        throw runtime_error("Duplicated profile '" + profile.name + "'");
+      }
+
+      try {
+        EnvParams& env = profile.env_params;
+        read_value(entry, "width", env.width);
+        read_value(entry, "height", env.height);
+        if (entry["f_xy"].empty()) {
+          read_value(entry, "fx", env.f_xy);
+        } else {
+          read_value(entry, "f_xy", env.f_xy);
+        }
+        read_value(entry, "X", env.X);
+        read_value(entry, "Y", env.Y);
+        read_value(entry, "Z", env.Z);
+        read_value(entry, "roll", env.roll);
+        read_value(entry, "pitch", env.pitch);
+        read_value(entry, "yaw", env.yaw);
+        env.isFullHeight = false;
+        if (!entry["isFullHeight"].empty()) {
+          read_value(entry, "isFullHeight", env.isFullHeight);
+        }
+
+        // 内部パラメータ (省略時は従来の1つの焦点距離と画像の中心)
+        env.fx = env.f_xy;
+        env.fy = env.f_xy;
+        env.cx = env.width / 2;
+        env.cy = env.height / 2;
+        read_optional(entry, "fx", env.fx);
+        read_optional(entry, "fy", env.fy);
+        read_optional(entry, "cx", env.cx);
+        read_optional(entry, "cy", env.cy);
+        fill(env.distortion, env.distortion + 5, 0.0);
+        cv::FileNode distortion = entry["distortion"];
+        if (!distortion.empty()) {
+          if (!distortion.isSeq() || distortion.size() > 5) {
+            throw runtime_error("'distortion' must be [k1, k2, p1, p2, k3]");
+          }
+          for (int i = 0; i < distortion.size(); i++) {
+            env.distortion[i] = (double)distortion[i];
+          }
+        }
+        if (env.width <= 0 || env.height <= 0 || env.fx <= 0 || env.fy <= 0) {
+          throw runtime_error("Invalid image size or focal length");
+        }
+
+        string lidar_name = (string)entry["lidar"];
+        if (!lidar_name.empty()) {
+          if (!loaded->lidars.count(lidar_name)) {
+            throw runtime_error("Unknown LiDAR '" + lidar_name + "'");
+          }
+          env.lidar = loaded->lidars[lidar_name];
+        }
+        int layer_cnt = env.lidar ? env.lidar->layer_cnt() : 64;
+        env.down_layer_cnt = 16;
+        read_optional(entry, "down_layers", env.down_layer_cnt);
+        if (env.down_layer_cnt <= 0 || env.down_layer_cnt > layer_cnt) {
+          throw runtime_error("'down_layers' must be in [1, " +
+                              to_string(layer_cnt) + "]");
+        }
+
+        profile.hyper_params = hyper;
+        read_hyper_params(entry["hyper_params"], profile.hyper_params);
+      } catch (const runtime_error& e) {
+        throw runtime_error("Profile '" + profile.name + "': " + e.what());
+      }
+
+      loaded->profiles[profile.name] = profile;
+    }
+  } catch (const runtime_error& e) {
+    throw runtime_error(path + ": " + e.what());
+  }
+  return loaded;
+}
+
+const Profile& ProfileRegistry::get(const string& name) const {
+  auto it = profiles.find(name);
+  if (it == profiles.end()) {
+    throw out_of_range("Unknown calibration setting name: " + name);
+  }
+  return it->second;
+}
+
+bool ProfileRegistry::contains(const string& name) const {
+  return profiles.count(name) > 0;
+}
+
+vector<string> ProfileRegistry::names() const {
+  vector<string> result;
+  for (auto it = profiles.begin(); it != profiles.end(); it++) {
+    result.push_back(it->first);
+  }
+  return result;
+}
+
+const HyperParams& ProfileRegistry::default_hyper() const {
+  return default_hyper_params;
+}
+
+shared_ptr<const LidarModel> ProfileRegistry::lidar(const string& name) const {
+  auto it = lidars.find(name);
+  if (it == lidars.end()) {
+    throw out_of_range("Unknown LiDAR name: " + name);
+  }
+  return it->second;
+}
+
+shared_ptr<const ProfileRegistry> profiles() {
+  lock_guard<mutex> lock(registry_mutex);
+  string path = current_path();
+  FileStamp stamp = file_stamp(path);
+  if (registry && stamp == registry_stamp) {
+    return registry;
+  }
+
+  try {
+    registry = ProfileRegistry::load(path);
+    registry_stamp = stamp;
+  } catch (const runtime_error& e) {
+    if (!registry) {
+      throw;
+    }
+    // 読み直しに失敗した場合は前の内容を使い，同じファイルは読み直さない
+    cerr << e.what() << endl;
+    registry_stamp = stamp;
+  }
+  return registry;
+}
+
+void set_profiles_path(const string& path) {
+  lock_guard<mutex> lock(registry_mutex);
+  registry_path = path;
+  registry.reset();
+}
+
+EnvParams load_env_params(string params_name) {
+  return profiles()->get(params_name).env_params;
+}
+
+HyperParams load_hyper_params(string params_name) {
+  return profiles()->get(params_name).hyper_params;
 }
 
 HyperParams load_default_hyper_params() {
-  HyperParams params;
-  bool is_rgb = true;
-  if (is_rgb) {
-    params = {1.5, 1, 10, 1.6, 19, 7, 440, 1.3, 7, 0.32};
-  } else {
-    params = {1.5, 1, 10, 1.6, 19, 7, 440, 1.3, 7, 0.32};
-    // Spare
-    // params = {1.5, 1, 10, 1.6, 19, 7, 820, 1.6, 7, 0.03};
-  }
-
-  return params;
-}
\ No newline at end of file
+  return profiles()->default_hyper();
+}
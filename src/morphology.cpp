@@ -0,0 +1,199 @@
+#include <limits>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "morphology.h"
+#include "parallel.h"
+
+using namespace std;
+
+namespace {
+struct MaxOp {
+  static double identity() { return -numeric_limits<double>::infinity(); }
+  double operator()(double a, double b) const { return a > b ? a : b; }
+};
+
+struct MinOp {
+  static double identity() { return numeric_limits<double>::infinity(); }
+  double operator()(double a, double b) const { return a < b ? a : b; }
+};
+
+/*
+Running max/min of the window [i - k, i + k] on a line (van Herk/Gil-Werman)
+長さw = 2k + 1のブロックごとに前方/後方の累積を取り，2つの値の比較で窓の値を得る
+*/
+template <typename Op>
+void running_filter(const double* src, int src_step, double* dst, int dst_step,
+                    int n, int k, Op op) {
+  thread_local vector<double> padded, prefix, suffix;
+  int w = 2 * k + 1;
+  int m = n + 2 * k;
+  padded.assign(m, Op::identity());
+  prefix.resize(m);
+  suffix.resize(m);
+  for (int i = 0; i < n; i++) {
+    padded[i + k] = src[i * src_step];
+  }
+
+  for (int i = 0; i < m; i++) {
+    prefix[i] = i % w == 0 ? padded[i] : op(prefix[i - 1], padded[i]);
+  }
+  for (int i = m - 1; i >= 0; i--) {
+    suffix[i] = (i + 1) % w == 0 || i == m - 1 ? padded[i]
+                                               : op(suffix[i + 1], padded[i]);
+  }
+
+  for (int i = 0; i < n; i++) {
+    dst[i * dst_step] = op(suffix[i], prefix[i + w - 1]);
+  }
+}
+
+template <typename Op>
+void separable_filter(const cv::Mat& src, cv::Mat& dst, int kx, int ky,
+                      const cv::Mat* keep, Op op) {
+  // keepがdstと同じ領域なら上書きされる前に退避する
+  cv::Mat keep_copy;
+  if (keep != nullptr && keep->data == dst.data) {
+    keep_copy = keep->clone();
+    keep = &keep_copy;
+  }
+
+  int rows = src.rows;
+  int cols = src.cols;
+  dst.create(rows, cols, CV_64FC1);
+
+  // 横方向
+  parallel_for(0, rows, [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      running_filter(src.ptr<double>(y), 1, dst.ptr<double>(y), 1, cols,
+                     kx / 2, op);
+    }
+  });
+
+  // 縦方向
+  int step = dst.step[0] / sizeof(double);
+  parallel_for(0, cols, [&](int begin, int end) {
+    for (int x = begin; x < end; x++) {
+      double* column = dst.ptr<double>() + x;
+      running_filter(column, step, column, step, rows, ky / 2, op);
+      if (keep == nullptr) {
+        continue;
+      }
+      for (int y = 0; y < rows; y++) {
+        double d = keep->at<double>(y, x);
+        if (d > 0) {
+          column[y * step] = d;
+        }
+      }
+    }
+  });
+}
+}  // namespace
+
+void max_filter(const cv::Mat& src, cv::Mat& dst, int kx, int ky,
+                const cv::Mat* keep) {
+  separable_filter(src, dst, kx, ky, keep, MaxOp());
+}
+
+void min_filter(const cv::Mat& src, cv::Mat& dst, int kx, int ky) {
+  separable_filter(src, dst, kx, ky, nullptr, MinOp());
+}
+
+void cross_max_filter(const cv::Mat& src, cv::Mat& dst) {
+  cv::Mat in = src.data == dst.data ? src.clone() : src;
+  int rows = in.rows;
+  int cols = in.cols;
+  dst.create(rows, cols, CV_64FC1);
+  parallel_for(0, rows, [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      const double* now = in.ptr<double>(y);
+      const double* up = y > 0 ? in.ptr<double>(y - 1) : nullptr;
+      const double* down = y + 1 < rows ? in.ptr<double>(y + 1) : nullptr;
+      double* out = dst.ptr<double>(y);
+      for (int x = 0; x < cols; x++) {
+        double val = now[x];
+        if (x > 0) {
+          val = max(val, now[x - 1]);
+        }
+        if (x + 1 < cols) {
+          val = max(val, now[x + 1]);
+        }
+        if (up != nullptr) {
+          val = max(val, up[x]);
+        }
+        if (down != nullptr) {
+          val = max(val, down[x]);
+        }
+        out[x] = val;
+      }
+    }
+  });
+}
+
+void ip_basic(const cv::Mat& src_grid, cv::Mat& dst_grid,
+              IpBasicWorkspace& workspace) {
+  double max_dist = 500;
+  int rows = src_grid.rows;
+  int cols = src_grid.cols;
+  cv::Mat& inverted = workspace.inverted;
+  cv::Mat& dilated = workspace.dilated;
+  cv::Mat& filled = workspace.filled;
+
+  inverted.create(rows, cols, CV_64FC1);
+  parallel_for(0, rows, [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      const double* src = src_grid.ptr<double>(y);
+      double* dst = inverted.ptr<double>(y);
+      for (int x = 0; x < cols; x++) {
+        dst[x] = src[x] > 0 ? max_dist - src[x] : 0;
+      }
+    }
+  });
+
+  // ひし形(5x5)の膨張は十字(3x3)の膨張2回と等しい
+  cross_max_filter(inverted, dilated);
+  cross_max_filter(dilated, inverted);
+
+  // Closing (5x5)
+  max_filter(inverted, dilated, 5, 5);
+  min_filter(dilated, dilated, 5, 5);
+
+  // 元の値を残しながら膨張 (7x7)
+  max_filter(dilated, filled, 7, 7, &dilated);
+
+  // 各列の最上部の値で上を埋める
+  parallel_for(0, cols, [&](int begin, int end) {
+    for (int x = begin; x < end; x++) {
+      int top = rows;
+      for (int y = 0; y < rows; y++) {
+        if (filled.at<double>(y, x) > 0) {
+          top = y;
+          break;
+        }
+      }
+      if (top == rows) {
+        continue;
+      }
+
+      double fill_val = filled.at<double>(top, x);
+      for (int y = 0; y < top; y++) {
+        filled.at<double>(y, x) = fill_val;
+      }
+    }
+  });
+
+  // 元の値を残しながら膨張 (31x31)
+  max_filter(filled, dilated, 31, 31, &filled);
+
+  dst_grid.create(rows, cols, CV_64FC1);
+  parallel_for(0, rows, [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      const double* src = dilated.ptr<double>(y);
+      double* dst = dst_grid.ptr<double>(y);
+      for (int x = 0; x < cols; x++) {
+        dst[x] = src[x] > 0 ? max_dist - src[x] : 0;
+      }
+    }
+  });
+}
@@ -0,0 +1,151 @@
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef HAVE_TBB
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
+#endif
+#include <opencv2/opencv.hpp>
+
+#include "parallel.h"
+
+using namespace std;
+
+namespace {
+atomic<ParallelBackend> backend(ParallelBackend::OPENCV);
+atomic<int> thread_cnt(0);
+thread_local bool nested = false;
+
+#ifdef HAVE_TBB
+mutex arena_mutex;
+shared_ptr<tbb::task_arena> arena;
+
+shared_ptr<tbb::task_arena> get_arena() {
+  lock_guard<mutex> lock(arena_mutex);
+  if (!arena) {
+    arena = make_shared<tbb::task_arena>(parallel_threads());
+  }
+  return arena;
+}
+#endif
+}  // namespace
+
+SerialRegion::SerialRegion() : prev(nested) { nested = true; }
+
+SerialRegion::~SerialRegion() { nested = prev; }
+
+bool set_parallel_backend(ParallelBackend new_backend) {
+#ifndef _OPENMP
+  if (new_backend == ParallelBackend::OPENMP) {
+    return false;
+  }
+#endif
+#ifndef HAVE_TBB
+  if (new_backend == ParallelBackend::TBB) {
+    return false;
+  }
+#endif
+  backend = new_backend;
+  return true;
+}
+
+bool set_parallel_backend(const string& name) {
+  if (name == "serial") {
+    return set_parallel_backend(ParallelBackend::SERIAL);
+  }
+  if (name == "opencv") {
+    return set_parallel_backend(ParallelBackend::OPENCV);
+  }
+  if (name == "openmp") {
+    return set_parallel_backend(ParallelBackend::OPENMP);
+  }
+  if (name == "tbb") {
+    return set_parallel_backend(ParallelBackend::TBB);
+  }
+  return false;
+}
+
+ParallelBackend parallel_backend() { return backend; }
+
+void set_parallel_threads(int threads) {
+  thread_cnt = max(0, threads);
+  // OpenCVの関数(cv::dilateなど)も同じスレッド数で動かす
+  cv::setNumThreads(threads > 0 ? threads : -1);
+#ifdef HAVE_TBB
+  lock_guard<mutex> lock(arena_mutex);
+  arena.reset();
+#endif
+}
+
+int parallel_threads() {
+  int threads = thread_cnt;
+  if (threads > 0) {
+    return threads;
+  }
+  return max(1, (int)thread::hardware_concurrency());
+}
+
+bool in_parallel_region() { return nested; }
+
+void parallel_for(int begin, int end, const function<void(int, int)>& body) {
+  if (end <= begin) {
+    return;
+  }
+  int threads = parallel_threads();
+  if (nested || threads == 1 || end - begin == 1 ||
+      backend == ParallelBackend::SERIAL) {
+    body(begin, end);
+    return;
+  }
+
+  // 負荷の偏りを均すため，スレッド数より細かく分割する
+  int chunk_cnt = min(end - begin, threads * 4);
+  auto run_chunk = [&](int c) {
+    SerialRegion scope;
+    long long len = end - begin;
+    body(begin + len * c / chunk_cnt, begin + len * (c + 1) / chunk_cnt);
+  };
+
+  switch (backend.load()) {
+    case ParallelBackend::OPENCV:
+      cv::parallel_for_(
+          cv::Range(0, chunk_cnt),
+          [&](const cv::Range& range) {
+            for (int c = range.start; c < range.end; c++) {
+              run_chunk(c);
+            }
+          },
+          chunk_cnt);
+      break;
+    case ParallelBackend::OPENMP:
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(threads) schedule(dynamic)
+      for (int c = 0; c < chunk_cnt; c++) {
+        run_chunk(c);
+      }
+#endif
+      break;
+    case ParallelBackend::TBB:
+#ifdef HAVE_TBB
+      get_arena()->execute([&]() {
+        tbb::parallel_for(tbb::blocked_range<int>(0, chunk_cnt),
+                          [&](const tbb::blocked_range<int>& range) {
+                            for (int c = range.begin(); c < range.end(); c++) {
+                              run_chunk(c);
+                            }
+                          });
+      });
+#endif
+      break;
+    default:
+      body(begin, end);
+      break;
+  }
+}
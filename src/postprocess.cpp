@@ -1,3 +1,4 @@
+#include <functional>
 #include <vector>
 
 #include <pcl/point_cloud.h>
@@ -5,10 +6,78 @@
 #include <opencv2/opencv.hpp>
 
 #include "models.h"
+#include "parallel.h"
 #include "postprocess.h"
 
 using namespace std;
 
+size_t GroundTruthIndex::bytes() const
+{
+  return (cells.size() + block_cells.size()) * sizeof(cv::Point) +
+         (row_offsets.size() + block_row_offsets.size() +
+          block_offsets.size()) *
+             sizeof(int);
+}
+
+void build_ground_truth_index(cv::Mat &original_grid, int block_size,
+                              GroundTruthIndex &index)
+{
+  int height = original_grid.rows;
+  int width = original_grid.cols;
+  index.rows = height;
+  index.cols = width;
+  index.block_size = block_size;
+
+  index.cells.clear();
+  index.row_offsets.assign(1, 0);
+  for (int i = 0; i < height; i++)
+  {
+    const double *row = original_grid.ptr<double>(i);
+    for (int j = 0; j < width; j++)
+    {
+      if (row[j] > 1e-9)
+      {
+        index.cells.push_back(cv::Point(j, i));
+      }
+    }
+    index.row_offsets.push_back(index.cells.size());
+  }
+
+  // ブロックの行ごとに，ブロック内は行優先の順で並べる(全走査の場合と同じ順)
+  int nbBlockPerHeight = height / block_size;
+  int nbBlockPerWidth = width / block_size;
+  index.block_row_offsets.assign(1, 0);
+  index.block_offsets.assign(1, 0);
+  index.block_cells.clear();
+  vector<vector<cv::Point>> blocks(nbBlockPerWidth);
+  for (int k = 0; k < nbBlockPerHeight; k++)
+  {
+    for (int i = k * block_size; i < (k + 1) * block_size; i++)
+    {
+      for (int c = index.row_offsets[i]; c < index.row_offsets[i + 1]; c++)
+      {
+        int l = index.cells[c].x / block_size;
+        if (l < nbBlockPerWidth)
+        {
+          blocks[l].push_back(index.cells[c]);
+        }
+      }
+    }
+    for (int l = 0; l < nbBlockPerWidth; l++)
+    {
+      if (blocks[l].empty())
+      {
+        continue;
+      }
+      index.block_cells.insert(index.block_cells.end(), blocks[l].begin(),
+                               blocks[l].end());
+      index.block_offsets.push_back(index.block_cells.size());
+      blocks[l].clear();
+    }
+    index.block_row_offsets.push_back(index.block_offsets.size() - 1);
+  }
+}
+
 namespace qm
 {
   // sigma on block_size
@@ -54,26 +123,33 @@ namespace qm
   // Mean reprojection error
   double mre(cv::Mat &img1, cv::Mat &img2)
   {
-    double error = 0;
     int height = img1.rows;
     int width = img1.cols;
-    int cnt = 0;
 
-    double o_min = 1000;
-    for (int i = 0; i < height; i++)
-    {
-      for (int j = 0; j < width; j++)
-      {
-        double o = img1.at<double>(i, j);
-        double r = img2.at<double>(i, j);
-        if (o > 1e-9 && r > 1e-9)
+    // 行ごとの(誤差の和, 点数)
+    cv::Vec2d sum = parallel_reduce(
+        0, height, cv::Vec2d(0, 0),
+        [&](int begin, int end)
         {
-          error += abs((o - r) / o);
-          cnt++;
-          o_min = min(o_min, o);
-        }
-      }
-    }
+          cv::Vec2d partial(0, 0);
+          for (int i = begin; i < end; i++)
+          {
+            for (int j = 0; j < width; j++)
+            {
+              double o = img1.at<double>(i, j);
+              double r = img2.at<double>(i, j);
+              if (o > 1e-9 && r > 1e-9)
+              {
+                partial[0] += abs((o - r) / o);
+                partial[1]++;
+              }
+            }
+          }
+          return partial;
+        },
+        plus<cv::Vec2d>());
+    double error = sum[0];
+    int cnt = sum[1];
 
     if (cnt == 0)
     {
@@ -88,39 +164,33 @@ namespace qm
   // Mean squared error
   double eqm(cv::Mat &img1, cv::Mat &img2)
   {
-    double eqm = 0;
     int height = img1.rows;
     int width = img1.cols;
-    int cnt = 0;
-    int cannot = 0;
-    int ground_cnt = 0;
-    int interpolate_cnt = 0;
 
-    for (int i = 0; i < height; i++)
-    {
-      for (int j = 0; j < width; j++)
-      {
-        double o = img1.at<double>(i, j);
-        double r = img2.at<double>(i, j);
-        if (o > 1e-9 && r > 1e-9)
-        {
-          eqm += (o - r) * (o - r);
-          cnt++;
-        }
-        if (o > 1e-9 && r <= 1e-9)
+    // 行ごとの(二乗誤差の和, 点数)
+    cv::Vec2d sum = parallel_reduce(
+        0, height, cv::Vec2d(0, 0),
+        [&](int begin, int end)
         {
-          cannot++;
-        }
-        if (o > 1e-9)
-        {
-          ground_cnt++;
-        }
-        if (r > 1e-9)
-        {
-          interpolate_cnt++;
-        }
-      }
-    }
+          cv::Vec2d partial(0, 0);
+          for (int i = begin; i < end; i++)
+          {
+            for (int j = 0; j < width; j++)
+            {
+              double o = img1.at<double>(i, j);
+              double r = img2.at<double>(i, j);
+              if (o > 1e-9 && r > 1e-9)
+              {
+                partial[0] += (o - r) * (o - r);
+                partial[1]++;
+              }
+            }
+          }
+          return partial;
+        },
+        plus<cv::Vec2d>());
+    double eqm = sum[0];
+    int cnt = sum[1];
 
     if (cnt == 0)
     {
@@ -142,72 +212,78 @@ namespace qm
   // Compute the SSIM between 2 images
   double ssim(cv::Mat &img1, cv::Mat &img2, int block_size)
   {
-    double mssim = 0;
-
     double C1 = 0.01 * 100 * 0.01 * 100;
     double C2 = 0.03 * 100 * 0.03 * 100;
 
     int nbBlockPerHeight = img1.rows / block_size;
     int nbBlockPerWidth = img1.cols / block_size;
-    int validBlocks = 0;
 
-    for (int k = 0; k < nbBlockPerHeight; k++)
-    {
-      for (int l = 0; l < nbBlockPerWidth; l++)
-      {
-        int m = k * block_size;
-        int n = l * block_size;
-
-        int cnt = 0;
-        double avg_o = 0;
-        double avg_r = 0;
-        double avg2_o = 0;
-        double avg2_r = 0;
-        double avg_or = 0;
-        for (int i = 0; i < block_size; i++)
+    // ブロックの行ごとの(SSIMの和, 有効なブロック数)
+    cv::Vec2d sum = parallel_reduce(
+        0, nbBlockPerHeight, cv::Vec2d(0, 0),
+        [&](int begin, int end)
         {
-          for (int j = 0; j < block_size; j++)
+          cv::Vec2d partial(0, 0);
+          for (int k = begin; k < end; k++)
           {
-            double o = img1.at<double>(m + i, n + j);
-            double r = img2.at<double>(m + i, n + j);
-            if (o > 1e-9 && r > 1e-9)
+            for (int l = 0; l < nbBlockPerWidth; l++)
             {
-              avg_o += o;
-              avg2_o += o * o;
-              avg_r += r;
-              avg2_r += r * r;
-              avg_or += o * r;
-              cnt++;
+              int m = k * block_size;
+              int n = l * block_size;
+
+              int cnt = 0;
+              double avg_o = 0;
+              double avg_r = 0;
+              double avg2_o = 0;
+              double avg2_r = 0;
+              double avg_or = 0;
+              for (int i = 0; i < block_size; i++)
+              {
+                for (int j = 0; j < block_size; j++)
+                {
+                  double o = img1.at<double>(m + i, n + j);
+                  double r = img2.at<double>(m + i, n + j);
+                  if (o > 1e-9 && r > 1e-9)
+                  {
+                    avg_o += o;
+                    avg2_o += o * o;
+                    avg_r += r;
+                    avg2_r += r * r;
+                    avg_or += o * r;
+                    cnt++;
+                  }
+                }
+              }
+
+              if (cnt == 0)
+              {
+                continue;
+              }
+
+              avg_o /= cnt;
+              avg2_o /= cnt;
+              avg_r /= cnt;
+              avg2_r /= cnt;
+              avg_or /= cnt;
+
+              double sigma2_o = avg2_o - avg_o * avg_o;
+              double sigma2_r = avg2_r - avg_r * avg_r;
+              double sigma_or = avg_or - avg_o * avg_r;
+
+              double ssim = ((2 * avg_o * avg_r + C1) * (2 * sigma_or + C2)) /
+                            ((avg_o * avg_o + avg_r * avg_r + C1) *
+                             (sigma2_o + sigma2_r + C2));
+              ssim = min(1.0, ssim);
+              ssim = max(0.0, ssim);
+              partial[0] += ssim;
+              partial[1]++;
             }
           }
-        }
-
-        if (cnt == 0)
-        {
-        }
-        else
-        {
-          avg_o /= cnt;
-          avg2_o /= cnt;
-          avg_r /= cnt;
-          avg2_r /= cnt;
-          avg_or /= cnt;
-
-          double sigma2_o = avg2_o - avg_o * avg_o;
-          double sigma2_r = avg2_r - avg_r * avg_r;
-          double sigma_or = avg_or - avg_o * avg_r;
-
-          double ssim =
-              ((2 * avg_o * avg_r + C1) * (2 * sigma_or + C2)) /
-              ((avg_o * avg_o + avg_r * avg_r + C1) * (sigma2_o + sigma2_r + C2));
-          ssim = min(1.0, ssim);
-          ssim = max(0.0, ssim);
-          mssim += ssim;
-
-          validBlocks++;
-        }
-      }
-    }
+          return partial;
+        },
+        plus<cv::Vec2d>());
+    double mssim = sum[0];
+    int validBlocks = sum[1];
 
     if (validBlocks == 0)
     {
@@ -222,37 +298,223 @@ namespace qm
   // Compute the f value between img1 (original) and img2 (reference)
   double f_value(cv::Mat &img1, cv::Mat &img2)
   {
-    int tp = 0;
-    int fp = 0;
-    int fn = 0;
-    int tn = 0;
     int height = img1.rows;
     int width = img1.cols;
 
-    for (int i = 0; i < height; i++)
-    {
-      for (int j = 0; j < width; j++)
-      {
-        double o = img1.at<double>(i, j);
-        double r = img2.at<double>(i, j);
-        if (o > 1e-9 && r > 1e-9)
+    // 行ごとの(tp, fp, fn)
+    cv::Vec3i counts = parallel_reduce(
+        0, height, cv::Vec3i(0, 0, 0),
+        [&](int begin, int end)
         {
-          tp++;
-        }
-        else if (o > 1e-9)
+          cv::Vec3i partial(0, 0, 0);
+          for (int i = begin; i < end; i++)
+          {
+            for (int j = 0; j < width; j++)
+            {
+              double o = img1.at<double>(i, j);
+              double r = img2.at<double>(i, j);
+              if (o > 1e-9 && r > 1e-9)
+              {
+                partial[0]++;
+              }
+              else if (r > 1e-9)
+              {
+                partial[1]++;
+              }
+              else if (o > 1e-9)
+              {
+                partial[2]++;
+              }
+            }
+          }
+          return partial;
+        },
+        plus<cv::Vec3i>());
+    int tp = counts[0];
+    int fp = counts[1];
+    int fn = counts[2];
+
+    double precision = (0.0 + tp) / (tp + fp);
+    double recall = (0.0 + tp) / (tp + fn);
+    return 2 * precision * recall / (precision + recall);
+  }
+
+  // Same as above, but only on the valid cells of img1
+  double mre(cv::Mat &img1, cv::Mat &img2, const GroundTruthIndex &index)
+  {
+    // 行ごとの(誤差の和, 点数)
+    cv::Vec2d sum = parallel_reduce(
+        0, index.rows, cv::Vec2d(0, 0),
+        [&](int begin, int end)
         {
-          fn++;
-        }
-        else if (r > 1e-9)
+          cv::Vec2d partial(0, 0);
+          for (int c = index.row_offsets[begin]; c < index.row_offsets[end];
+               c++)
+          {
+            double o = img1.at<double>(index.cells[c]);
+            double r = img2.at<double>(index.cells[c]);
+            if (r > 1e-9)
+            {
+              partial[0] += abs((o - r) / o);
+              partial[1]++;
+            }
+          }
+          return partial;
+        },
+        plus<cv::Vec2d>());
+    double error = sum[0];
+    int cnt = sum[1];
+
+    if (cnt == 0)
+    {
+      return 1e9;
+    }
+    else
+    {
+      return error / cnt;
+    }
+  }
+
+  double eqm(cv::Mat &img1, cv::Mat &img2, const GroundTruthIndex &index)
+  {
+    // 行ごとの(二乗誤差の和, 点数)
+    cv::Vec2d sum = parallel_reduce(
+        0, index.rows, cv::Vec2d(0, 0),
+        [&](int begin, int end)
         {
-          fp++;
-        }
-        else
+          cv::Vec2d partial(0, 0);
+          for (int c = index.row_offsets[begin]; c < index.row_offsets[end];
+               c++)
+          {
+            double o = img1.at<double>(index.cells[c]);
+            double r = img2.at<double>(index.cells[c]);
+            if (r > 1e-9)
+            {
+              partial[0] += (o - r) * (o - r);
+              partial[1]++;
+            }
+          }
+          return partial;
+        },
+        plus<cv::Vec2d>());
+    double eqm = sum[0];
+    int cnt = sum[1];
+
+    if (cnt == 0)
+    {
+      return 1e9;
+    }
+    else
+    {
+      return eqm / cnt;
+    }
+  }
+
+  double ssim(cv::Mat &img1, cv::Mat &img2, const GroundTruthIndex &index)
+  {
+    double C1 = 0.01 * 100 * 0.01 * 100;
+    double C2 = 0.03 * 100 * 0.03 * 100;
+
+    // 真値のないブロックは全走査でも数えないので飛ばす
+    cv::Vec2d sum = parallel_reduce(
+        0, (int)index.block_row_offsets.size() - 1, cv::Vec2d(0, 0),
+        [&](int begin, int end)
         {
-          tn++;
-        }
-      }
+          cv::Vec2d partial(0, 0);
+          for (int b = index.block_row_offsets[begin];
+               b < index.block_row_offsets[end]; b++)
+          {
+            int cnt = 0;
+            double avg_o = 0;
+            double avg_r = 0;
+            double avg2_o = 0;
+            double avg2_r = 0;
+            double avg_or = 0;
+            for (int c = index.block_offsets[b]; c < index.block_offsets[b + 1];
+                 c++)
+            {
+              double o = img1.at<double>(index.block_cells[c]);
+              double r = img2.at<double>(index.block_cells[c]);
+              if (r > 1e-9)
+              {
+                avg_o += o;
+                avg2_o += o * o;
+                avg_r += r;
+                avg2_r += r * r;
+                avg_or += o * r;
+                cnt++;
+              }
+            }
+
+            if (cnt == 0)
+            {
+              continue;
+            }
+
+            avg_o /= cnt;
+            avg2_o /= cnt;
+            avg_r /= cnt;
+            avg2_r /= cnt;
+            avg_or /= cnt;
+
+            double sigma2_o = avg2_o - avg_o * avg_o;
+            double sigma2_r = avg2_r - avg_r * avg_r;
+            double sigma_or = avg_or - avg_o * avg_r;
+
+            double ssim = ((2 * avg_o * avg_r + C1) * (2 * sigma_or + C2)) /
+                          ((avg_o * avg_o + avg_r * avg_r + C1) *
+                           (sigma2_o + sigma2_r + C2));
+            ssim = min(1.0, ssim);
+            ssim = max(0.0, ssim);
+            partial[0] += ssim;
+            partial[1]++;
+          }
+          return partial;
+        },
+        plus<cv::Vec2d>());
+    double mssim = sum[0];
+    int validBlocks = sum[1];
+
+    if (validBlocks == 0)
+    {
+      return 0;
     }
+    else
+    {
+      return mssim / validBlocks;
+    }
+  }
+
+  double f_value(cv::Mat &img1, cv::Mat &img2, const GroundTruthIndex &index)
+  {
+    int height = img2.rows;
+    int width = img2.cols;
+
+    // 行ごとの(真値のあるセルで補完された点数, 補完された点数)
+    cv::Vec2i counts = parallel_reduce(
+        0, height, cv::Vec2i(0, 0),
+        [&](int begin, int end)
+        {
+          cv::Vec2i partial(0, 0);
+          for (int c = index.row_offsets[begin]; c < index.row_offsets[end];
+               c++)
+          {
+            partial[0] += img2.at<double>(index.cells[c]) > 1e-9;
+          }
+          for (int i = begin; i < end; i++)
+          {
+            const double *row = img2.ptr<double>(i);
+            for (int j = 0; j < width; j++)
+            {
+              partial[1] += row[j] > 1e-9;
+            }
+          }
+          return partial;
+        },
+        plus<cv::Vec2i>());
+    int tp = counts[0];
+    int fp = counts[1] - tp;
+    int fn = index.cells.size() - tp;
 
     double precision = (0.0 + tp) / (tp + fp);
     double recall = (0.0 + tp) / (tp + fn);
@@ -263,44 +525,208 @@ namespace qm
 void evaluate(cv::Mat &grid, cv::Mat &original_grid, EnvParams &env_params,
               double &ssim, double &mse, double &mre, double &f_val)
 {
-  ssim = qm::ssim(original_grid, grid, 4);
-  mse = qm::eqm(original_grid, grid);
-  mre = qm::mre(original_grid, grid);
-  f_val = qm::f_value(original_grid, grid);
+  GroundTruthIndex gt_index;
+  build_ground_truth_index(original_grid, 4, gt_index);
+  evaluate(grid, original_grid, gt_index, env_params, ssim, mse, mre, f_val);
 }
 
-void restore_pointcloud(cv::Mat &grid, cv::Mat &vs, EnvParams env_params,
-                        pcl::PointCloud<pcl::PointXYZ> &dst_cloud)
+void evaluate(cv::Mat &grid, cv::Mat &original_grid,
+              const GroundTruthIndex &gt_index, EnvParams &env_params,
+              double &ssim, double &mse, double &mre, double &f_val)
 {
-  dst_cloud = pcl::PointCloud<pcl::PointXYZ>();
+  ssim = qm::ssim(original_grid, grid, gt_index);
+  mse = qm::eqm(original_grid, grid, gt_index);
+  mre = qm::mre(original_grid, grid, gt_index);
+  f_val = qm::f_value(original_grid, grid, gt_index);
+}
 
-  for (int i = 0; i < vs.rows; i++)
+namespace
+{
+  // Number of points per row and their offsets in the output
+  size_t count_restored_points(const cv::Mat &grid, bool skip_invalid,
+                               vector<size_t> &offsets)
   {
-    double *row = grid.ptr<double>(i);
-    for (int j = 0; j < vs.cols; j++)
+    offsets.assign(grid.rows + 1, 0);
+    parallel_for(0, grid.rows, [&](int begin, int end) {
+      for (int i = begin; i < end; i++)
+      {
+        if (!skip_invalid)
+        {
+          offsets[i + 1] = grid.cols;
+          continue;
+        }
+
+        const double *row = grid.ptr<double>(i);
+        size_t cnt = 0;
+        for (int j = 0; j < grid.cols; j++)
+        {
+          cnt += row[j] > 0;
+        }
+        offsets[i + 1] = cnt;
+      }
+    });
+    for (int i = 0; i < grid.rows; i++)
     {
-      double z = row[j];
-      if (z <= 0)
+      offsets[i + 1] += offsets[i];
+    }
+    return offsets[grid.rows];
+  }
+
+  // 行ごとに並列で逆投影し，write(idx, x, y, z)で書き込む
+  template <typename Writer>
+  void back_project(const cv::Mat &grid, const cv::Mat &vs,
+                    EnvParams &env_params, bool skip_invalid,
+                    const vector<size_t> &offsets, const Writer &write)
+  {
+    parallel_for(0, grid.rows, [&](int begin, int end) {
+      for (int i = begin; i < end; i++)
       {
-        // continue;
+        const double *row = grid.ptr<double>(i);
+        const ushort *v_row = vs.ptr<ushort>(i);
+        size_t idx = offsets[i];
+        for (int j = 0; j < grid.cols; j++)
+        {
+          double z = row[j];
+          if (skip_invalid && z <= 0)
+          {
+            continue;
+          }
+
+          double x = z * (j - env_params.cx) / env_params.fx;
+          double y = z * (v_row[j] - env_params.cy) / env_params.fy;
+          write(idx++, x, y, z);
+        }
       }
+    });
+  }
+} // namespace
 
-      double x = z * (j - env_params.width / 2) / env_params.f_xy;
-      double y =
-          z * (vs.at<ushort>(i, j) - env_params.height / 2) / env_params.f_xy;
-      dst_cloud.points.push_back(pcl::PointXYZ(x, y, z));
-    }
+void restore_pointcloud(cv::Mat &grid, cv::Mat &vs, EnvParams env_params,
+                        pcl::PointCloud<pcl::PointXYZ> &dst_cloud,
+                        bool skip_invalid)
+{
+  vector<size_t> offsets;
+  size_t cnt = count_restored_points(grid, skip_invalid, offsets);
+
+  dst_cloud = pcl::PointCloud<pcl::PointXYZ>();
+  dst_cloud.points.resize(cnt);
+  dst_cloud.width = cnt;
+  dst_cloud.height = 1;
+  dst_cloud.is_dense = skip_invalid;
+
+  pcl::PointXYZ *dst = dst_cloud.points.data();
+  back_project(grid, vs, env_params, skip_invalid, offsets,
+               [dst](size_t idx, double x, double y, double z) {
+                 dst[idx] = pcl::PointXYZ(x, y, z);
+               });
+}
+
+size_t restore_pointcloud(const cv::Mat &grid, const cv::Mat &vs,
+                          EnvParams &env_params, pcl::PointXYZ *dst,
+                          size_t capacity, bool skip_invalid)
+{
+  vector<size_t> offsets;
+  size_t cnt = count_restored_points(grid, skip_invalid, offsets);
+  if (cnt > capacity)
+  {
+    return cnt;
+  }
+
+  back_project(grid, vs, env_params, skip_invalid, offsets,
+               [dst](size_t idx, double x, double y, double z) {
+                 dst[idx] = pcl::PointXYZ(x, y, z);
+               });
+  return cnt;
+}
+
+size_t restore_pointcloud(const cv::Mat &grid, const cv::Mat &vs,
+                          EnvParams &env_params, float *xs, float *ys,
+                          float *zs, size_t capacity, bool skip_invalid)
+{
+  vector<size_t> offsets;
+  size_t cnt = count_restored_points(grid, skip_invalid, offsets);
+  if (cnt > capacity)
+  {
+    return cnt;
   }
+
+  back_project(grid, vs, env_params, skip_invalid, offsets,
+               [xs, ys, zs](size_t idx, double x, double y, double z) {
+                 xs[idx] = x;
+                 ys[idx] = y;
+                 zs[idx] = z;
+               });
+  return cnt;
 }
 
 void generate_depth_image(cv::Mat &grid, cv::Mat &img)
 {
   img = cv::Mat::zeros(grid.rows, grid.cols, CV_64FC1);
-  img.forEach<double>([&grid](double &now, const int position[]) -> void {
-    double val = grid.at<double>(position[0], position[1]);
-    if (val > 1e-9)
+  parallel_for_each<double>(
+      img, [&grid](double &now, const int position[]) -> void {
+        double val = grid.at<double>(position[0], position[1]);
+        if (val > 1e-9)
+        {
+          now = 1 - val / 40;
+        }
+      });
+}
+void upsample_dense(const cv::Mat &grid, const cv::Mat &vs,
+                    EnvParams &env_params, cv::Mat &dense, int tile_cols)
+{
+  dense = cv::Mat::zeros(env_params.height, env_params.width, CV_64FC1);
+  int cols = min(vs.cols, env_params.width);
+  int tile_cnt = (cols + tile_cols - 1) / tile_cols;
+
+  // 列のタイルごとに並列処理
+  parallel_for(0, tile_cnt, [&](int begin, int end) {
+    for (int t = begin; t < end; t++)
     {
-      now = 1 - val / 40;
+      int j_end = min(cols, (t + 1) * tile_cols);
+      for (int j = t * tile_cols; j < j_end; j++)
+      {
+        int prev_v = -1;
+        double prev_z = 0;
+        for (int i = 0; i < vs.rows; i++)
+        {
+          double next_z = grid.at<double>(i, j);
+          int next_v = vs.at<ushort>(i, j);
+          if (next_z <= 1e-9 || next_v >= env_params.height)
+          {
+            continue;
+          }
+
+          dense.at<double>(next_v, j) = next_z;
+          if (prev_v < 0 || prev_v >= next_v)
+          {
+            prev_v = next_v;
+            prev_z = next_z;
+            continue;
+          }
+
+          // Interpolate on the line between two points in the y-z plane
+          double prev_y = prev_z * (prev_v - env_params.cy) / env_params.fy;
+          double next_y = next_z * (next_v - env_params.cy) / env_params.fy;
+          bool is_flat = abs(next_y - prev_y) < 1e-9;
+          double angle = is_flat ? 0 : (next_z - prev_z) / (next_y - prev_y);
+          for (int v = prev_v + 1; v < next_v; v++)
+          {
+            double z;
+            if (is_flat)
+            {
+              z = prev_z + (next_z - prev_z) * (v - prev_v) / (next_v - prev_v);
+            }
+            else
+            {
+              double tan = (v - env_params.cy) / env_params.fy;
+              z = (prev_z - angle * prev_y) / (1 - tan * angle);
+            }
+            dense.at<double>(v, j) = z > 0 ? z : 0;
+          }
+          prev_v = next_v;
+          prev_z = next_z;
+        }
+      }
     }
   });
-}
\ No newline at end of file
+}
@@ -1,3 +1,6 @@
+#include <map>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 #include <pcl/filters/extract_indices.h>
@@ -7,11 +10,44 @@
 #include <pcl/point_types.h>
 #include <opencv2/opencv.hpp>
 
+#include "lidar.h"
 #include "models.h"
+#include "parallel.h"
 #include "preprocess.h"
 
 using namespace std;
 
+namespace {
+// Remap tables of cv::remap (fixed point)
+struct UndistortMaps {
+  cv::Mat map1;
+  cv::Mat map2;
+};
+
+mutex undistort_mutex;
+map<vector<double>, shared_ptr<UndistortMaps>> undistort_cache;
+
+// 点のないセルには，そのレイヤーの角度から求めた画像の行を入れる
+void fill_empty_vs(cv::Mat& vs, const LidarModel& lidar,
+                   const EnvParams& env_params) {
+  parallel_for_each<ushort>(vs, [&](ushort& now, const int position[]) -> void {
+    if (now > 0) {
+      return;
+    }
+
+    int v = round(env_params.cy +
+                  env_params.fy * tan(lidar.layer_rad(position[0])));
+    if (0 <= v && v < env_params.height) {
+      now = (ushort)v;
+    }
+  });
+}
+}  // namespace
+
+bool keep_layer(int layer, int layer_cnt, int down_layer_cnt) {
+  return (long long)layer * down_layer_cnt % layer_cnt < down_layer_cnt;
+}
+
 /*
 Downsample point cloud
 */
@@ -19,27 +55,53 @@ void downsample(pcl::PointCloud<pcl::PointXYZ>& src_cloud,
                 pcl::PointCloud<pcl::PointXYZ>& dst_cloud,
                 double min_angle_degree, double max_angle_degree,
                 int original_layer_cnt, int down_layer_cnt) {
-  double PI = acos(-1);
-  double min_rad = min_angle_degree * PI / 180;
-  double delta_rad = (max_angle_degree - min_angle_degree) /
-                     (original_layer_cnt - 1) * PI / 180;
-
-  dst_cloud = pcl::PointCloud<pcl::PointXYZ>();
+  LidarModel lidar = LidarModel::uniform("", original_layer_cnt,
+                                         min_angle_degree, max_angle_degree);
+  downsample(src_cloud, dst_cloud, lidar, down_layer_cnt);
+}
 
-  for (int i = 0; i < src_cloud.points.size(); i++) {
-    double x = src_cloud.points[i].x;
-    double y = src_cloud.points[i].y;
-    double z = src_cloud.points[i].z;
+void downsample(const pcl::PointCloud<pcl::PointXYZ>& src_cloud,
+                pcl::PointCloud<pcl::PointXYZ>& dst_cloud,
+                const LidarModel& lidar, int down_layer_cnt,
+                const vector<uint16_t>* rings, vector<uint16_t>* dst_rings) {
+  int original_layer_cnt = lidar.layer_cnt();
 
-    double r = sqrt(x * x + z * z);
+  // 点ごとの判定は並列に行い，元の順序のまま詰める
+  int point_cnt = src_cloud.points.size();
+  if (rings != nullptr && rings->size() != point_cnt) {
+    rings = nullptr;
+  }
+  vector<char> keep(point_cnt, 0);
+  parallel_for(0, point_cnt, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      int idx;
+      if (rings != nullptr) {
+        idx = lidar.layer_of_ring((*rings)[i]);
+      } else {
+        double x = src_cloud.points[i].x;
+        double y = src_cloud.points[i].y;
+        double z = src_cloud.points[i].z;
+        idx = lidar.layer_of(y, sqrt(x * x + z * z));
+      }
+      if (idx < 0) {
+        continue;
+      }
 
-    int idx = (int)((atan2(y, r) - min_rad) / delta_rad);
-    if (idx < 0 || idx >= original_layer_cnt) {
-      continue;
+      keep[i] = keep_layer(idx, original_layer_cnt, down_layer_cnt);
     }
+  });
 
-    if (idx % (original_layer_cnt / down_layer_cnt) == 0) {
-      dst_cloud.points.push_back(pcl::PointXYZ(x, y, z));
+  dst_cloud = pcl::PointCloud<pcl::PointXYZ>();
+  if (dst_rings != nullptr) {
+    dst_rings->clear();
+  }
+  for (int i = 0; i < point_cnt; i++) {
+    if (keep[i]) {
+      const pcl::PointXYZ& point = src_cloud.points[i];
+      dst_cloud.points.push_back(pcl::PointXYZ(point.x, point.y, point.z));
+      if (rings != nullptr && dst_rings != nullptr) {
+        dst_rings->push_back((*rings)[i]);
+      }
     }
   }
 }
@@ -51,67 +113,146 @@ Transform point cloud into depth image
 void grid_pointcloud(const pcl::PointCloud<pcl::PointXYZ>& src_cloud,
                      double min_angle_degree, double max_angle_degree,
                      int target_layer_cnt, EnvParams& env_params, cv::Mat& grid,
-                     cv::Mat& vs) {
-  double PI = acos(-1);
-  double min_rad = min_angle_degree * PI / 180;
-  double delta_rad =
-      (max_angle_degree - min_angle_degree) / (target_layer_cnt - 1) * PI / 180;
+                     cv::Mat& vs, GridReducer reducer) {
+  LidarModel lidar = LidarModel::uniform("", target_layer_cnt,
+                                         min_angle_degree, max_angle_degree);
+  grid_pointcloud(src_cloud, lidar, env_params, grid, vs, reducer);
+}
+
+void grid_pointcloud(const pcl::PointCloud<pcl::PointXYZ>& src_cloud,
+                     const LidarModel& lidar, EnvParams& env_params,
+                     cv::Mat& grid, cv::Mat& vs, GridReducer reducer,
+                     const vector<uint16_t>* rings) {
+  int target_layer_cnt = lidar.layer_cnt();
 
   // キャリブレーション
   grid = cv::Mat::zeros(target_layer_cnt, env_params.width, CV_64FC1);
   vs = cv::Mat::zeros(target_layer_cnt, env_params.width, CV_16SC1);
 
-  double rollVal = (env_params.roll - 500) / 1000.0;
-  double pitchVal = (env_params.pitch - 500) / 1000.0;
-  double yawVal = (env_params.yaw - 500) / 1000.0;
-  Eigen::MatrixXd calibration_mtx(4, 4);
-  calibration_mtx << cos(yawVal) * cos(pitchVal),
-      cos(yawVal) * sin(pitchVal) * sin(rollVal) - sin(yawVal) * cos(rollVal),
-      cos(yawVal) * sin(pitchVal) * cos(rollVal) + sin(yawVal) * sin(rollVal),
-      (env_params.X - 500) / 100.0, sin(yawVal) * cos(pitchVal),
-      sin(yawVal) * sin(pitchVal) * sin(rollVal) + cos(yawVal) * cos(rollVal),
-      sin(yawVal) * sin(pitchVal) * cos(rollVal) - cos(yawVal) * sin(rollVal),
-      (env_params.Y - 500) / 100.0, -sin(pitchVal),
-      cos(pitchVal) * sin(rollVal), cos(pitchVal) * cos(rollVal),
-      (env_params.Z - 500) / 100.0, 0, 0, 0, 1;
-
-  for (int i = 0; i < src_cloud.points.size(); i++) {
-    double rawX = src_cloud.points[i].x;
-    double rawY = src_cloud.points[i].y;
-    double rawZ = src_cloud.points[i].z;
-
-    double rawR = sqrt(rawX * rawX + rawZ * rawZ);
-    double x = calibration_mtx(0, 0) * rawX + calibration_mtx(0, 1) * rawY +
-               calibration_mtx(0, 2) * rawZ + calibration_mtx(0, 3);
-    double y = calibration_mtx(1, 0) * rawX + calibration_mtx(1, 1) * rawY +
-               calibration_mtx(1, 2) * rawZ + calibration_mtx(1, 3);
-    double z = calibration_mtx(2, 0) * rawX + calibration_mtx(2, 1) * rawY +
-               calibration_mtx(2, 2) * rawZ + calibration_mtx(2, 3);
-    double r = sqrt(x * x + z * z);
-    int v_idx = (int)((atan2(y, r) - min_rad) / delta_rad);
-
-    if (z > 0) {
-      int u = round(env_params.width / 2 + env_params.f_xy * x / z);
-      int v = round(env_params.height / 2 + env_params.f_xy * y / z);
-      if (0 <= u && u < env_params.width && 0 <= v && v < env_params.height &&
-          0 <= v_idx && v_idx < vs.rows) {
-        grid.at<double>(v_idx, u) = z;
-        vs.at<ushort>(v_idx, u) = (ushort)v;
+  Eigen::Matrix4d calibration_mtx = calibration_matrix(env_params);
+
+  // 点ごとの投影先 (グリッド外はlayer = -1)
+  int point_cnt = src_cloud.points.size();
+  if (rings != nullptr && rings->size() != point_cnt) {
+    rings = nullptr;
+  }
+  vector<int> layers(point_cnt), us(point_cnt), v_rows(point_cnt);
+  vector<double> depths(point_cnt);
+  parallel_for(0, point_cnt, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      double rawX = src_cloud.points[i].x;
+      double rawY = src_cloud.points[i].y;
+      double rawZ = src_cloud.points[i].z;
+
+      double x = calibration_mtx(0, 0) * rawX + calibration_mtx(0, 1) * rawY +
+                 calibration_mtx(0, 2) * rawZ + calibration_mtx(0, 3);
+      double y = calibration_mtx(1, 0) * rawX + calibration_mtx(1, 1) * rawY +
+                 calibration_mtx(1, 2) * rawZ + calibration_mtx(1, 3);
+      double z = calibration_mtx(2, 0) * rawX + calibration_mtx(2, 1) * rawY +
+                 calibration_mtx(2, 2) * rawZ + calibration_mtx(2, 3);
+      // リングがあれば表を引くだけでレイヤーが決まる
+      int v_idx = rings != nullptr ? lidar.layer_of_ring((*rings)[i])
+                                   : lidar.layer_of(y, sqrt(x * x + z * z));
+
+      layers[i] = -1;
+      if (z > 0) {
+        int u = round(env_params.cx + env_params.fx * x / z);
+        int v = round(env_params.cy + env_params.fy * y / z);
+        if (0 <= u && u < env_params.width && 0 <= v &&
+            v < env_params.height && 0 <= v_idx && v_idx < vs.rows) {
+          layers[i] = v_idx;
+          us[i] = u;
+          v_rows[i] = v;
+          depths[i] = z;
+        }
       }
     }
-  }
+  });
 
-  vs.forEach<ushort>([&](ushort& now, const int position[]) -> void {
-    if (now > 0) {
-      return;
+  // レイヤーごとに点の順序を保ったまま振り分ける
+  vector<int> offsets(target_layer_cnt + 1, 0);
+  for (int i = 0; i < point_cnt; i++) {
+    if (layers[i] >= 0) {
+      offsets[layers[i] + 1]++;
     }
+  }
+  for (int l = 0; l < target_layer_cnt; l++) {
+    offsets[l + 1] += offsets[l];
+  }
+  vector<int> order(offsets.back());
+  vector<int> positions(offsets.begin(), offsets.end() - 1);
+  for (int i = 0; i < point_cnt; i++) {
+    if (layers[i] >= 0) {
+      order[positions[layers[i]]++] = i;
+    }
+  }
 
-    int v = round(env_params.height / 2 +
-                  env_params.f_xy * tan(min_rad + position[0] * delta_rad));
-    if (0 <= v && v < env_params.height) {
-      now = (ushort)v;
+  // レイヤーは互いに独立なので並列に集約する
+  parallel_for(0, target_layer_cnt, [&](int begin, int end) {
+    vector<int> cnts(env_params.width);
+    vector<double> v_sums(env_params.width);
+    for (int l = begin; l < end; l++) {
+      double* grid_row = grid.ptr<double>(l);
+      ushort* vs_row = vs.ptr<ushort>(l);
+      fill(cnts.begin(), cnts.end(), 0);
+      fill(v_sums.begin(), v_sums.end(), 0.0);
+      for (int n = offsets[l]; n < offsets[l + 1]; n++) {
+        int i = order[n];
+        int u = us[i];
+        double z = depths[i];
+        switch (reducer) {
+          case GridReducer::NEAREST:
+            if (cnts[u] == 0 || z < grid_row[u]) {
+              grid_row[u] = z;
+              vs_row[u] = (ushort)v_rows[i];
+            }
+            break;
+          case GridReducer::LAST:
+            grid_row[u] = z;
+            vs_row[u] = (ushort)v_rows[i];
+            break;
+          case GridReducer::MEAN:
+            grid_row[u] += z;
+            v_sums[u] += v_rows[i];
+            break;
+          case GridReducer::COUNT:
+            // 最も近い点の深度はv_sumsに置く
+            if (cnts[u] == 0 || z < v_sums[u]) {
+              v_sums[u] = z;
+              vs_row[u] = (ushort)v_rows[i];
+            }
+            grid_row[u]++;
+            break;
+        }
+        cnts[u]++;
+      }
+
+      if (reducer == GridReducer::MEAN) {
+        for (int u = 0; u < env_params.width; u++) {
+          if (cnts[u] > 0) {
+            grid_row[u] /= cnts[u];
+            vs_row[u] = (ushort)round(v_sums[u] / cnts[u]);
+          }
+        }
+      }
     }
   });
+
+  fill_empty_vs(vs, lidar, env_params);
+}
+
+void mask_layers(const cv::Mat& grid, const cv::Mat& vs,
+                 const LidarModel& lidar, EnvParams& env_params,
+                 int down_layer_cnt, cv::Mat& dst_grid, cv::Mat& dst_vs) {
+  dst_grid = grid.clone();
+  dst_vs = vs.clone();
+  for (int l = 0; l < grid.rows; l++) {
+    if (!keep_layer(l, grid.rows, down_layer_cnt)) {
+      dst_grid.row(l).setTo(0);
+      dst_vs.row(l).setTo(0);
+    }
+  }
+  fill_empty_vs(dst_vs, lidar, env_params);
 }
 
 void remove_noise(cv::Mat& src, cv::Mat& dst, cv::Mat& vs, EnvParams env_params,
@@ -126,9 +267,8 @@ void remove_noise(cv::Mat& src, cv::Mat& dst, cv::Mat& vs, EnvParams env_params,
         continue;
       }
 
-      double x = z * (j - env_params.width / 2) / env_params.f_xy;
-      double y =
-          z * (vs.at<ushort>(i, j) - env_params.height / 2) / env_params.f_xy;
+      double x = z * (j - env_params.cx) / env_params.fx;
+      double y = z * (vs.at<ushort>(i, j) - env_params.cy) / env_params.fy;
       cloud_ptr->points.push_back(pcl::PointXYZ(x, y, z));
     }
   }
@@ -138,34 +278,84 @@ void remove_noise(cv::Mat& src, cv::Mat& dst, cv::Mat& vs, EnvParams env_params,
   cv::Mat full_grid =
       cv::Mat::zeros(env_params.height, env_params.width, CV_64FC1);
   pcl::PointIndices::Ptr inliers(new pcl::PointIndices());
-  for (int i = 0; i < cloud_ptr->points.size(); i++) {
-    double x = cloud_ptr->points[i].x;
-    double y = cloud_ptr->points[i].y;
-    double z = cloud_ptr->points[i].z;
-    double distance2 = x * x + y * y + z * z;
 
-    //探索半径：係数*(距離)^2
-    double radius = rad_coef * distance2;
-
-    //最も近い点を探索し，半径r以内にあるか判定
+  // 近傍探索は並列に行い，書き込みは点の順に行う(同じ画素では後の点が残る)
+  int point_cnt = cloud_ptr->points.size();
+  vector<char> found(point_cnt, 0);
+  parallel_for(0, point_cnt, [&](int begin, int end) {
     vector<int> pointIdxNKNSearch;
     vector<float> pointNKNSquaredDistance;
-    int result = kdtree.radiusSearch((*cloud_ptr)[i], radius, pointIdxNKNSearch,
-                                     pointNKNSquaredDistance, min_k);
-    if (result == min_k) {
-      int u = round(x / z * env_params.f_xy + env_params.width / 2);
-      int v = round(y / z * env_params.f_xy + env_params.height / 2);
-      if (0 <= u < env_params.width && 0 <= v && v < env_params.height) {
-        full_grid.at<double>(v, u) = z;
-        inliers->indices.push_back(i);
-      }
+    for (int i = begin; i < end; i++) {
+      double x = cloud_ptr->points[i].x;
+      double y = cloud_ptr->points[i].y;
+      double z = cloud_ptr->points[i].z;
+      double distance2 = x * x + y * y + z * z;
+
+      //探索半径：係数*(距離)^2
+      double radius = rad_coef * distance2;
+
+      //最も近い点を探索し，半径r以内にあるか判定
+      int result =
+          kdtree.radiusSearch((*cloud_ptr)[i], radius, pointIdxNKNSearch,
+                              pointNKNSquaredDistance, min_k);
+      found[i] = result == min_k;
+    }
+  });
+
+  for (int i = 0; i < point_cnt; i++) {
+    if (!found[i]) {
+      continue;
+    }
+    double x = cloud_ptr->points[i].x;
+    double y = cloud_ptr->points[i].y;
+    double z = cloud_ptr->points[i].z;
+    int u = round(x / z * env_params.fx + env_params.cx);
+    int v = round(y / z * env_params.fy + env_params.cy);
+    if (0 <= u && u < env_params.width && 0 <= v && v < env_params.height) {
+      full_grid.at<double>(v, u) = z;
+      inliers->indices.push_back(i);
     }
   }
 
   dst = cv::Mat::zeros(vs.rows, vs.cols, CV_64FC1);
-  dst.forEach<double>(
-      [&full_grid, &vs](double& now, const int position[]) -> void {
+  parallel_for_each<double>(
+      dst, [&full_grid, &vs](double& now, const int position[]) -> void {
         now = full_grid.at<double>(vs.at<ushort>(position[0], position[1]),
                                    position[1]);
       });
-}
\ No newline at end of file
+}
+
+void undistort_image(const cv::Mat& src, cv::Mat& dst,
+                     const EnvParams& env_params) {
+  if (!has_distortion(env_params)) {
+    dst = src;
+    return;
+  }
+
+  vector<double> key = {(double)src.cols, (double)src.rows, env_params.fx,
+                        env_params.fy,    env_params.cx,    env_params.cy};
+  key.insert(key.end(), env_params.distortion, env_params.distortion + 5);
+
+  shared_ptr<UndistortMaps> maps;
+  {
+    lock_guard<mutex> lock(undistort_mutex);
+    shared_ptr<UndistortMaps>& cached = undistort_cache[key];
+    if (!cached) {
+      cached = make_shared<UndistortMaps>();
+      cv::Mat camera_mtx = cv::Mat::eye(3, 3, CV_64FC1);
+      camera_mtx.at<double>(0, 0) = env_params.fx;
+      camera_mtx.at<double>(0, 2) = env_params.cx;
+      camera_mtx.at<double>(1, 1) = env_params.fy;
+      camera_mtx.at<double>(1, 2) = env_params.cy;
+      cv::Mat distortion(1, 5, CV_64FC1, (void*)env_params.distortion);
+      cv::initUndistortRectifyMap(camera_mtx, distortion.clone(), cv::Mat(),
+                                  camera_mtx, src.size(), CV_16SC2,
+                                  cached->map1, cached->map2);
+    }
+    maps = cached;
+  }
+
+  cv::Mat undistorted;
+  cv::remap(src, undistorted, maps->map1, maps->map2, cv::INTER_LINEAR);
+  dst = undistorted;
+}
@@ -0,0 +1,241 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <opencv2/opencv.hpp>
+
+#include "parallel.h"
+#include "scheduler.h"
+
+using namespace std;
+
+namespace {
+// "0-3,8-11" -> {0, 1, 2, 3, 8, 9, 10, 11}
+vector<int> parse_cpulist(const string& list) {
+  vector<int> cpus;
+  stringstream ss(list);
+  string range;
+  while (getline(ss, range, ',')) {
+    if (range.empty() || range == "\n") {
+      continue;
+    }
+    size_t dash = range.find('-');
+    int first = stoi(range.substr(0, dash));
+    int last = dash == string::npos ? first : stoi(range.substr(dash + 1));
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+double elapsed_ms(chrono::steady_clock::time_point start) {
+  return chrono::duration<double, milli>(chrono::steady_clock::now() - start)
+      .count();
+}
+
+// OpenCVの関数(cv::GaussianBlurなど)もスレッド数を制限する
+struct OpenCVThreads {
+  int prev;
+  OpenCVThreads(int threads) : prev(cv::getNumThreads()) {
+    cv::setNumThreads(threads);
+  }
+  ~OpenCVThreads() { cv::setNumThreads(prev); }
+};
+}  // namespace
+
+bool parse_schedule_mode(const string& name, ScheduleMode& mode) {
+  if (name == "frames") {
+    mode = ScheduleMode::FRAMES;
+  } else if (name == "intra") {
+    mode = ScheduleMode::INTRA;
+  } else if (name == "auto") {
+    mode = ScheduleMode::AUTO;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+string schedule_mode_name(ScheduleMode mode) {
+  switch (mode) {
+    case ScheduleMode::FRAMES:
+      return "frames";
+    case ScheduleMode::INTRA:
+      return "intra";
+    default:
+      return "auto";
+  }
+}
+
+vector<NumaNode> numa_nodes() {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  bool has_mask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+  vector<NumaNode> nodes;
+  string root = "/sys/devices/system/node/";
+  DIR* dir = opendir(root.c_str());
+  if (dir != nullptr) {
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+      string name = entry->d_name;
+      if (name.compare(0, 4, "node") != 0 || name.size() == 4 ||
+          !isdigit(name[4])) {
+        continue;
+      }
+      ifstream ifs(root + name + "/cpulist");
+      string list;
+      if (!getline(ifs, list)) {
+        continue;
+      }
+
+      NumaNode node;
+      node.id = stoi(name.substr(4));
+      for (int cpu : parse_cpulist(list)) {
+        if (!has_mask || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))) {
+          node.cpus.push_back(cpu);
+        }
+      }
+      if (!node.cpus.empty()) {
+        nodes.push_back(node);
+      }
+    }
+    closedir(dir);
+  }
+
+  if (nodes.empty()) {
+    NumaNode node;
+    node.id = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (has_mask ? CPU_ISSET(cpu, &allowed)
+                   : cpu < (int)thread::hardware_concurrency()) {
+        node.cpus.push_back(cpu);
+      }
+    }
+    nodes.push_back(node);
+  }
+  sort(nodes.begin(), nodes.end(),
+       [](const NumaNode& a, const NumaNode& b) { return a.id < b.id; });
+  return nodes;
+}
+
+bool pin_current_thread(const vector<int>& cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    if (0 <= cpu && cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+void ScheduleStats::print(ostream& os) const {
+  os << "schedule=" << schedule_mode_name(mode) << " workers=" << workers
+     << " threads=" << threads << " frames=" << latency.count()
+     << " wall_ms=" << wall_ms << " throughput=" << throughput << "fps";
+  if (intra_ms > 0 || serial_ms > 0) {
+    os << " intra_ms=" << intra_ms << " serial_ms=" << serial_ms;
+  }
+  os << endl;
+  latency.print(os, "frame");
+}
+
+FrameScheduler::FrameScheduler(ScheduleMode mode, double max_latency_ms)
+    : mode(mode), max_latency_ms(max_latency_ms) {}
+
+ScheduleStats FrameScheduler::run(int frame_cnt,
+                                  const function<void(int)>& job) {
+  ScheduleStats stats;
+  stats.mode = mode;
+  int threads = parallel_threads();
+  stats.workers = 1;
+  stats.threads = threads;
+  stats.intra_ms = 0;
+  stats.serial_ms = 0;
+  int next = 0;
+  auto start = chrono::steady_clock::now();
+
+  auto run_intra = [&](int idx) {
+    auto frame_start = chrono::steady_clock::now();
+    job(idx);
+    double ms = elapsed_ms(frame_start);
+    stats.latency.record(ms);
+    return ms;
+  };
+
+  if (mode == ScheduleMode::AUTO) {
+    // 1フレーム目を全コアで，2フレーム目を1コアで処理して比べる
+    if (threads == 1 || frame_cnt < 3) {
+      stats.mode = ScheduleMode::INTRA;
+    } else {
+      stats.intra_ms = run_intra(next++);
+      {
+        SerialRegion serial;
+        OpenCVThreads cv_threads(1);
+        stats.serial_ms = run_intra(next++);
+      }
+
+      // 残りのフレームを同時に処理した場合のスループットと比べる
+      int workers = min(threads, frame_cnt - next);
+      bool faster = workers / stats.serial_ms > 1 / stats.intra_ms;
+      bool in_time = max_latency_ms <= 0 || stats.serial_ms <= max_latency_ms;
+      stats.mode = faster && in_time ? ScheduleMode::FRAMES
+                                     : ScheduleMode::INTRA;
+    }
+  }
+
+  if (stats.mode == ScheduleMode::INTRA) {
+    for (; next < frame_cnt; next++) {
+      run_intra(next);
+    }
+  } else {
+    vector<NumaNode> nodes = numa_nodes();
+    vector<int> cpu_nodes;
+    for (int n = 0; n < nodes.size(); n++) {
+      cpu_nodes.insert(cpu_nodes.end(), nodes[n].cpus.size(), n);
+    }
+
+    int workers = max(1, min(threads, frame_cnt - next));
+    stats.workers = workers;
+    stats.threads = 1;
+    atomic<int> next_frame(next);
+    mutex stats_mutex;
+    OpenCVThreads cv_threads(1);
+
+    vector<thread> pool;
+    for (int w = 0; w < workers; w++) {
+      // ノードごとのワーカー数はCPU数に比例する
+      const NumaNode& node =
+          nodes[cpu_nodes[(long long)w * cpu_nodes.size() / workers]];
+      pool.emplace_back([&, node]() {
+        pin_current_thread(node.cpus);
+        SerialRegion serial;
+        for (int idx = next_frame++; idx < frame_cnt; idx = next_frame++) {
+          auto frame_start = chrono::steady_clock::now();
+          job(idx);
+          double ms = elapsed_ms(frame_start);
+          lock_guard<mutex> lock(stats_mutex);
+          stats.latency.record(ms);
+        }
+      });
+    }
+    for (thread& worker : pool) {
+      worker.join();
+    }
+  }
+
+  stats.wall_ms = elapsed_ms(start);
+  stats.throughput =
+      stats.wall_ms > 0 ? stats.latency.count() * 1000 / stats.wall_ms : 0;
+  return stats;
+}
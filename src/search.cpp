@@ -0,0 +1,476 @@
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <set>
+
+#include "models.h"
+#include "search.h"
+
+using namespace std;
+
+vector<double> SearchDimension::grid() const {
+  vector<double> values;
+  if (step <= 0) {
+    values.push_back(min_val);
+    return values;
+  }
+  for (double val = min_val; val <= max_val; val += step) {
+    values.push_back(val);
+  }
+  return values;
+}
+
+vector<SearchDimension> search_space(string method_name) {
+  vector<SearchDimension> space;
+  if (method_name == "mrf") {
+    space.push_back({"K", 0.5, 3, 0.5,
+                     [](HyperParams& p, double val) { p.mrf_k = val; }});
+    space.push_back({"C", 0.5, 5, 0.5,
+                     [](HyperParams& p, double val) { p.mrf_c = val; }});
+  }
+  if (method_name == "bilateral-solver") {
+    space.push_back({"K", 0.5, 3, 0.5,
+                     [](HyperParams& p, double val) { p.mrf_k = val; }});
+    space.push_back({"Sigma S", 4, 16, 4, [](HyperParams& p, double val) {
+                       p.bs_sigma_s = val;
+                     }});
+    space.push_back({"Sigma L", 8, 32, 8, [](HyperParams& p, double val) {
+                       p.bs_sigma_l = val;
+                     }});
+  }
+  if (method_name == "pwas") {
+    space.push_back({"Sigma C", 10, 100, 10, [](HyperParams& p, double val) {
+                       p.pwas_sigma_c = val;
+                     }});
+    space.push_back({"Sigma S", 0.5, 2.5, 0.5, [](HyperParams& p, double val) {
+                       p.pwas_sigma_s = val;
+                     }});
+    space.push_back({"Sigma R", 1, 10, 1, [](HyperParams& p, double val) {
+                       p.pwas_sigma_r = val;
+                     }});
+    space.push_back({"R", 7, 7, 1, [](HyperParams& p, double val) {
+                       p.pwas_r = (int)round(val);
+                     }});
+  }
+  if (method_name == "domain-transform") {
+    space.push_back({"Sigma S", 5, 40, 5, [](HyperParams& p, double val) {
+                       p.dt_sigma_s = val;
+                     }});
+    space.push_back({"Sigma R", 10, 80, 10, [](HyperParams& p, double val) {
+                       p.dt_sigma_r = val;
+                     }});
+    space.push_back({"Iterations", 3, 3, 1, [](HyperParams& p, double val) {
+                       p.dt_iterations = (int)round(val);
+                     }});
+  }
+  if (method_name == "original") {
+    space.push_back({"Color segment K", 400, 500, 10,
+                     [](HyperParams& p, double val) {
+                       p.original_color_segment_k = val;
+                     }});
+    space.push_back({"Sigma S", 1.6, 1.6, 0.1, [](HyperParams& p, double val) {
+                       p.original_sigma_s = val;
+                     }});
+    space.push_back({"R", 7, 7, 2, [](HyperParams& p, double val) {
+                       p.original_r = (int)round(val);
+                     }});
+    space.push_back({"Coef S", 0.2, 0.4, 0.01, [](HyperParams& p, double val) {
+                       p.original_coef_s = val;
+                     }});
+  }
+  if (method_name == "pyramid") {
+    space.push_back({"Sigma S", 0.5, 2, 0.25, [](HyperParams& p, double val) {
+                       p.pyramid_sigma_s = val;
+                     }});
+    space.push_back({"Sigma R", 2, 20, 2, [](HyperParams& p, double val) {
+                       p.pyramid_sigma_r = val;
+                     }});
+  }
+  return space;
+}
+
+HyperParams SearchStrategy::to_params(const vector<double>& values) const {
+  HyperParams params = base_params;
+  for (int i = 0; i < space.size(); i++) {
+    space[i].set(params, values[i]);
+  }
+  return params;
+}
+
+SearchStrategy::SearchStrategy() : batch_size(1), pruning(true) {}
+
+void SearchStrategy::set_pruning(bool pruning) { this->pruning = pruning; }
+
+void SearchStrategy::set_batch_objective(const BatchObjective& batch_objective,
+                                         int batch_size) {
+  this->batch_objective = batch_objective;
+  this->batch_size = max(1, batch_size);
+}
+
+double SearchStrategy::evaluate(const vector<double>& values, int frame_cnt,
+                                double bound) {
+  vector<double>& errors = memo[values];
+  if (errors.empty()) {
+    errors.assign(this->frame_cnt, -1);
+  }
+
+  // Frames already evaluated first, then the hardest frames
+  vector<int> order;
+  double error_sum = 0;
+  for (int i = 0; i < frame_cnt; i++) {
+    if (errors[i] >= 0) {
+      error_sum += errors[i];
+    } else {
+      order.push_back(i);
+    }
+  }
+  auto difficulty = [&](int i) {
+    return frame_error_cnts[i] == 0 ? 0
+                                    : frame_error_sums[i] / frame_error_cnts[i];
+  };
+  stable_sort(order.begin(), order.end(),
+              [&](int a, int b) { return difficulty(a) > difficulty(b); });
+
+  HyperParams params = to_params(values);
+  for (int k = 0; k < order.size(); k++) {
+    if (pruning && error_sum / frame_cnt > bound) {
+      best.pruned_evaluations += order.size() - k;
+      return error_sum / frame_cnt;
+    }
+
+    int i = order[k];
+    errors[i] = objective(params, i);
+    error_sum += errors[i];
+    frame_error_sums[i] += errors[i];
+    frame_error_cnts[i]++;
+    best.evaluations++;
+  }
+  return error_sum / frame_cnt;
+}
+
+double SearchStrategy::evaluate_full(const vector<double>& values) {
+  double error = evaluate(values, frame_cnt, best.error);
+  if (best.error > error) {
+    best.error = error;
+    best.values = values;
+    best.params = to_params(values);
+    if (on_update) {
+      on_update(best);
+    }
+  }
+  return error;
+}
+
+void SearchStrategy::evaluate_full(
+    const vector<vector<double>>& candidates) {
+  if (!batch_objective) {
+    for (int k = 0; k < candidates.size(); k++) {
+      evaluate_full(candidates[k]);
+    }
+    return;
+  }
+
+  for (int begin = 0; begin < candidates.size(); begin += batch_size) {
+    int end = min((int)candidates.size(), begin + batch_size);
+    int cnt = end - begin;
+    double bound = best.error;
+
+    vector<vector<double>*> errors;
+    vector<HyperParams> params;
+    vector<double> error_sums(cnt, 0);
+    vector<bool> is_alive(cnt, true);
+    for (int k = 0; k < cnt; k++) {
+      vector<double>& candidate_errors = memo[candidates[begin + k]];
+      if (candidate_errors.empty()) {
+        candidate_errors.assign(frame_cnt, -1);
+      }
+      errors.push_back(&candidate_errors);
+      params.push_back(to_params(candidates[begin + k]));
+      for (int i = 0; i < frame_cnt; i++) {
+        if (candidate_errors[i] >= 0) {
+          error_sums[k] += candidate_errors[i];
+        }
+      }
+    }
+
+    // Hardest frames first
+    vector<int> order(frame_cnt);
+    for (int i = 0; i < frame_cnt; i++) {
+      order[i] = i;
+    }
+    auto difficulty = [&](int i) {
+      return frame_error_cnts[i] == 0
+                 ? 0
+                 : frame_error_sums[i] / frame_error_cnts[i];
+    };
+    stable_sort(order.begin(), order.end(),
+                [&](int a, int b) { return difficulty(a) > difficulty(b); });
+
+    for (int n = 0; n < frame_cnt; n++) {
+      int i = order[n];
+      vector<int> targets;
+      vector<HyperParams> target_params;
+      for (int k = 0; k < cnt; k++) {
+        if (!is_alive[k] || (*errors[k])[i] >= 0) {
+          continue;
+        }
+        if (pruning && error_sums[k] / frame_cnt > bound) {
+          is_alive[k] = false;
+          best.pruned_evaluations +=
+              count_if(errors[k]->begin(), errors[k]->end(),
+                       [](double error) { return error < 0; });
+          continue;
+        }
+        targets.push_back(k);
+        target_params.push_back(params[k]);
+      }
+      if (targets.empty()) {
+        continue;
+      }
+
+      vector<double> results = batch_objective(target_params, i);
+      for (int t = 0; t < targets.size(); t++) {
+        int k = targets[t];
+        (*errors[k])[i] = results[t];
+        error_sums[k] += results[t];
+        frame_error_sums[i] += results[t];
+        frame_error_cnts[i]++;
+        best.evaluations++;
+      }
+    }
+
+    for (int k = 0; k < cnt; k++) {
+      double error = error_sums[k] / frame_cnt;
+      if (best.error > error) {
+        best.error = error;
+        best.values = candidates[begin + k];
+        best.params = params[k];
+        if (on_update) {
+          on_update(best);
+        }
+      }
+    }
+  }
+}
+
+SearchResult SearchStrategy::search(const vector<SearchDimension>& space,
+                                    const HyperParams& base_params,
+                                    const Objective& objective, int frame_cnt,
+                                    const SearchCallback& on_update) {
+  this->space = space;
+  this->base_params = base_params;
+  this->objective = objective;
+  this->frame_cnt = frame_cnt;
+  this->on_update = on_update;
+  memo.clear();
+  frame_error_sums.assign(frame_cnt, 0);
+  frame_error_cnts.assign(frame_cnt, 0);
+
+  best.params = base_params;
+  best.values.clear();
+  best.error = 1e18;
+  best.evaluations = 0;
+  best.pruned_evaluations = 0;
+  if (!space.empty() && frame_cnt > 0) {
+    run();
+  }
+  return best;
+}
+
+void GridSearch::run() {
+  vector<vector<double>> grids;
+  for (int i = 0; i < space.size(); i++) {
+    grids.push_back(space[i].grid());
+  }
+
+  // Same order as nested loops (the last dimension is the innermost)
+  vector<vector<double>> candidates;
+  vector<int> idx(space.size(), 0);
+  vector<double> values(space.size());
+  while (true) {
+    for (int i = 0; i < space.size(); i++) {
+      values[i] = grids[i][idx[i]];
+    }
+    candidates.push_back(values);
+
+    int d = space.size() - 1;
+    while (d >= 0 && ++idx[d] == grids[d].size()) {
+      idx[d] = 0;
+      d--;
+    }
+    if (d < 0) {
+      break;
+    }
+  }
+  evaluate_full(candidates);
+}
+
+RandomSearch::RandomSearch(int trials, unsigned int seed)
+    : trials(trials), seed(seed) {}
+
+void RandomSearch::run() {
+  mt19937 engine(seed);
+  vector<vector<double>> grids;
+  for (int i = 0; i < space.size(); i++) {
+    grids.push_back(space[i].grid());
+  }
+
+  vector<vector<double>> candidates;
+  vector<double> values(space.size());
+  for (int t = 0; t < trials; t++) {
+    for (int i = 0; i < space.size(); i++) {
+      uniform_int_distribution<int> dist(0, grids[i].size() - 1);
+      values[i] = grids[i][dist(engine)];
+    }
+    candidates.push_back(values);
+  }
+  evaluate_full(candidates);
+}
+
+CoarseToFineSearch::CoarseToFineSearch(int points_per_dim)
+    : points_per_dim(max(2, points_per_dim)) {}
+
+void CoarseToFineSearch::run() {
+  vector<vector<double>> grids;
+  vector<int> lo, hi;
+  for (int i = 0; i < space.size(); i++) {
+    grids.push_back(space[i].grid());
+    lo.push_back(0);
+    hi.push_back(grids[i].size() - 1);
+  }
+
+  while (true) {
+    // Indices to evaluate in this round
+    vector<vector<int>> candidates(space.size());
+    int max_stride = 0;
+    for (int i = 0; i < space.size(); i++) {
+      int stride = max(1, (hi[i] - lo[i]) / (points_per_dim - 1));
+      for (int k = lo[i]; k <= hi[i]; k += stride) {
+        candidates[i].push_back(k);
+      }
+      if (candidates[i].back() != hi[i]) {
+        candidates[i].push_back(hi[i]);
+      }
+      max_stride = max(max_stride, hi[i] > lo[i] ? stride : 0);
+    }
+
+    vector<vector<double>> round_candidates;
+    vector<int> idx(space.size(), 0);
+    vector<double> values(space.size());
+    while (true) {
+      for (int i = 0; i < space.size(); i++) {
+        values[i] = grids[i][candidates[i][idx[i]]];
+      }
+      round_candidates.push_back(values);
+
+      int d = space.size() - 1;
+      while (d >= 0 && ++idx[d] == candidates[d].size()) {
+        idx[d] = 0;
+        d--;
+      }
+      if (d < 0) {
+        break;
+      }
+    }
+    evaluate_full(round_candidates);
+
+    if (max_stride <= 1) {
+      break;
+    }
+
+    // Narrow the range around the best
+    for (int i = 0; i < space.size(); i++) {
+      int best_idx = find(grids[i].begin(), grids[i].end(), best.values[i]) -
+                     grids[i].begin();
+      int stride = max(1, (hi[i] - lo[i]) / (points_per_dim - 1));
+      int half = max(1, stride - 1);
+      lo[i] = max(lo[i], best_idx - half);
+      hi[i] = min(hi[i], best_idx + half);
+      if (stride == 1) {
+        lo[i] = hi[i] = best_idx;
+      }
+    }
+  }
+}
+
+SuccessiveHalving::SuccessiveHalving(int candidates, int min_frames, int eta,
+                                     unsigned int seed)
+    : candidates(candidates),
+      min_frames(max(1, min_frames)),
+      eta(max(2, eta)),
+      seed(seed) {}
+
+void SuccessiveHalving::run() {
+  vector<vector<double>> grids;
+  double grid_size = 1;
+  for (int i = 0; i < space.size(); i++) {
+    grids.push_back(space[i].grid());
+    grid_size *= grids[i].size();
+  }
+
+  // Sample distinct candidates on the grid
+  mt19937 engine(seed);
+  set<vector<double>> sampled;
+  int target = min((double)candidates, grid_size);
+  while (sampled.size() < target) {
+    vector<double> values(space.size());
+    for (int i = 0; i < space.size(); i++) {
+      uniform_int_distribution<int> dist(0, grids[i].size() - 1);
+      values[i] = grids[i][dist(engine)];
+    }
+    sampled.insert(values);
+  }
+  vector<vector<double>> survivors(sampled.begin(), sampled.end());
+
+  int frames = min(min_frames, frame_cnt);
+  while (true) {
+    if (frames >= frame_cnt || survivors.size() == 1) {
+      for (int k = 0; k < survivors.size(); k++) {
+        evaluate_full(survivors[k]);
+      }
+      break;
+    }
+
+    // 上位keep個に入れない候補は打ち切る
+    int keep = max(1, (int)survivors.size() / eta);
+    vector<pair<double, int>> errors;
+    multiset<double> kept_errors;
+    for (int k = 0; k < survivors.size(); k++) {
+      double bound = 1e18;
+      if (kept_errors.size() == keep) {
+        bound = *kept_errors.rbegin();
+      }
+      double error = evaluate(survivors[k], frames, bound);
+      errors.emplace_back(error, k);
+      kept_errors.insert(error);
+      if (kept_errors.size() > keep) {
+        kept_errors.erase(prev(kept_errors.end()));
+      }
+    }
+    sort(errors.begin(), errors.end());
+
+    vector<vector<double>> next;
+    for (int k = 0; k < keep; k++) {
+      next.push_back(survivors[errors[k].second]);
+    }
+    survivors = next;
+    frames = min(frames * eta, frame_cnt);
+  }
+}
+
+shared_ptr<SearchStrategy> make_search_strategy(string strategy_name,
+                                                int trials) {
+  if (strategy_name == "grid") {
+    return make_shared<GridSearch>();
+  }
+  if (strategy_name == "random") {
+    return make_shared<RandomSearch>(trials);
+  }
+  if (strategy_name == "coarse-to-fine") {
+    return make_shared<CoarseToFineSearch>();
+  }
+  if (strategy_name == "halving") {
+    return make_shared<SuccessiveHalving>(trials);
+  }
+  return nullptr;
+}
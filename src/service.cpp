@@ -0,0 +1,268 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <opencv2/opencv.hpp>
+
+#include "frame_cache.h"
+#include "service.h"
+
+using namespace std;
+
+namespace {
+// Upper limit of a message, to reject broken streams
+const uint64_t MAX_MESSAGE_BYTES = 1ULL << 30;
+
+bool write_all(int fd, const void* data, size_t length) {
+  const char* p = (const char*)data;
+  while (length > 0) {
+    ssize_t written = write(fd, p, length);
+    if (written <= 0) {
+      return false;
+    }
+    p += written;
+    length -= written;
+  }
+  return true;
+}
+
+bool read_all(int fd, void* data, size_t length) {
+  char* p = (char*)data;
+  while (length > 0) {
+    ssize_t n = read(fd, p, length);
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    length -= n;
+  }
+  return true;
+}
+
+bool write_string(int fd, const string& str) {
+  uint32_t length = str.size();
+  return write_all(fd, &length, sizeof(length)) &&
+         write_all(fd, str.data(), length);
+}
+
+bool read_string(int fd, string& str) {
+  uint32_t length;
+  if (!read_all(fd, &length, sizeof(length)) || length > MAX_MESSAGE_BYTES) {
+    return false;
+  }
+  str.resize(length);
+  return read_all(fd, &str[0], length);
+}
+
+sockaddr_un unix_address(const string& path) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  return addr;
+}
+}  // namespace
+
+LatencyHistogram::LatencyHistogram()
+    : total_cnt(0), sum(0), max_val(0) {
+  // 0.5ms - 8s (2^(1/2)倍ずつ)
+  for (double bound = 0.5; bound <= 8000; bound *= sqrt(2.0)) {
+    bounds.push_back(bound);
+  }
+  counts.assign(bounds.size() + 1, 0);
+}
+
+void LatencyHistogram::record(double ms) {
+  int idx = lower_bound(bounds.begin(), bounds.end(), ms) - bounds.begin();
+  counts[idx]++;
+  total_cnt++;
+  sum += ms;
+  max_val = std::max(max_val, ms);
+}
+
+long long LatencyHistogram::count() const { return total_cnt; }
+
+double LatencyHistogram::mean() const {
+  return total_cnt > 0 ? sum / total_cnt : 0;
+}
+
+double LatencyHistogram::max() const { return max_val; }
+
+double LatencyHistogram::percentile(double p) const {
+  long long target = ceil(p * total_cnt);
+  long long cnt = 0;
+  for (int i = 0; i < bounds.size(); i++) {
+    cnt += counts[i];
+    if (cnt >= target && cnt > 0) {
+      return bounds[i];
+    }
+  }
+  return max_val;
+}
+
+void LatencyHistogram::print(ostream& os, const string& label) const {
+  long long cnt = 0;
+  for (int i = 0; i < bounds.size(); i++) {
+    cnt += counts[i];
+    os << label << " le=" << bounds[i] << " " << cnt << endl;
+  }
+  os << label << " le=+Inf " << total_cnt << endl;
+  os << label << " mean=" << mean() << " p50=" << percentile(0.5)
+     << " p99=" << percentile(0.99) << " max=" << max_val << endl;
+}
+
+InterpolationService::InterpolationService(const ServiceConfig& config,
+                                           const FrameProcessor& processor)
+    : config(config),
+      processor(processor),
+      expected_ms(config.methods.size(), -1),
+      last_frames(config.methods.size(), 0),
+      frame_cnt(0),
+      fallback_cnt(0),
+      missed_cnt(0) {}
+
+int InterpolationService::choose_method(double remaining_ms) const {
+  // 処理時間が未知の手法は一度試す
+  // 一度だけ遅かった手法(コールドスタートなど)も，しばらくしたら測り直す
+  for (int i = 0; i < config.methods.size(); i++) {
+    if (expected_ms[i] < 0 || expected_ms[i] <= remaining_ms ||
+        (config.probe_interval > 0 &&
+         frame_cnt - last_frames[i] >= config.probe_interval)) {
+      return i;
+    }
+  }
+  return config.methods.size() - 1;
+}
+
+ServiceResult InterpolationService::process(
+    const string& name, pcl::PointCloud<pcl::PointXYZ>& cloud, cv::Mat& img,
+    double elapsed_ms) {
+  ServiceResult result;
+  result.name = name;
+
+  int idx = choose_method(config.deadline_ms - elapsed_ms);
+  result.method = config.methods[idx];
+  result.fallback = idx > 0;
+
+  auto start = chrono::steady_clock::now();
+  processor(result.method, cloud, img, result.grid);
+  double process_ms =
+      chrono::duration<double, milli>(chrono::steady_clock::now() - start)
+          .count();
+
+  // 長く使っていなかった手法の予測は古いので置き換える
+  bool stale = config.probe_interval > 0 &&
+               frame_cnt - last_frames[idx] >= config.probe_interval;
+  if (expected_ms[idx] < 0 || stale) {
+    expected_ms[idx] = process_ms;
+  } else {
+    expected_ms[idx] += config.smoothing * (process_ms - expected_ms[idx]);
+  }
+  last_frames[idx] = frame_cnt;
+  frame_cnt++;
+
+  result.latency_ms = elapsed_ms + process_ms;
+  result.deadline_missed = result.latency_ms > config.deadline_ms;
+  total_histogram.record(result.latency_ms);
+  method_histograms[result.method].record(process_ms);
+  fallback_cnt += result.fallback;
+  missed_cnt += result.deadline_missed;
+  return result;
+}
+
+const LatencyHistogram& InterpolationService::latency() const {
+  return total_histogram;
+}
+
+void InterpolationService::print_stats(ostream& os) const {
+  os << "frames=" << total_histogram.count() << " fallbacks=" << fallback_cnt
+     << " deadline_misses=" << missed_cnt << endl;
+  total_histogram.print(os, "latency");
+  for (auto it = method_histograms.begin(); it != method_histograms.end();
+       it++) {
+    it->second.print(os, "process_" + it->first);
+  }
+}
+
+int64_t monotonic_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int listen_unix_socket(const string& path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  unlink(path.c_str());
+  sockaddr_un addr = unix_address(path);
+  if (bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 1) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int connect_unix_socket(const string& path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  sockaddr_un addr = unix_address(path);
+  if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool send_frame(int fd, const string& name, int64_t captured_ns,
+                const pcl::PointCloud<pcl::PointXYZ>& cloud,
+                const cv::Mat& img, const vector<uint16_t>* rings) {
+  vector<char> buffer;
+  encode_frame(cloud, img, buffer, 0, 0, rings);
+  uint64_t length = buffer.size();
+  return write_string(fd, name) &&
+         write_all(fd, &captured_ns, sizeof(captured_ns)) &&
+         write_all(fd, &length, sizeof(length)) &&
+         write_all(fd, buffer.data(), length);
+}
+
+bool receive_frame(int fd, string& name, int64_t& captured_ns, cv::Mat& img,
+                   pcl::PointCloud<pcl::PointXYZ>& cloud,
+                   vector<uint16_t>* rings) {
+  uint64_t length;
+  if (!read_string(fd, name) ||
+      !read_all(fd, &captured_ns, sizeof(captured_ns)) ||
+      !read_all(fd, &length, sizeof(length)) || length > MAX_MESSAGE_BYTES) {
+    return false;
+  }
+  vector<char> buffer(length);
+  return read_all(fd, buffer.data(), length) &&
+         decode_frame(buffer.data(), length, img, cloud, rings);
+}
+
+bool send_result(int fd, const ServiceResult& result) {
+  uint8_t flags = (result.fallback ? 1 : 0) | (result.deadline_missed ? 2 : 0);
+  return write_string(fd, result.name) && write_string(fd, result.method) &&
+         write_all(fd, &flags, sizeof(flags)) &&
+         write_all(fd, &result.latency_ms, sizeof(result.latency_ms));
+}
+
+bool receive_result(int fd, ServiceResult& result) {
+  uint8_t flags;
+  if (!read_string(fd, result.name) || !read_string(fd, result.method) ||
+      !read_all(fd, &flags, sizeof(flags)) ||
+      !read_all(fd, &result.latency_ms, sizeof(result.latency_ms))) {
+    return false;
+  }
+  result.fallback = flags & 1;
+  result.deadline_missed = flags & 2;
+  return true;
+}
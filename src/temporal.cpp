@@ -0,0 +1,318 @@
+#include <climits>
+#include <vector>
+
+#include <Eigen/Core>
+#include <opencv2/opencv.hpp>
+
+#include "lidar.h"
+#include "methods.h"
+#include "models.h"
+#include "parallel.h"
+#include "temporal.h"
+
+using namespace std;
+
+cv::Mat changed_tiles(const cv::Mat& prev, const cv::Mat& now, cv::Size tile,
+                      double threshold, int min_cells) {
+  int tile_rows = (now.rows + tile.height - 1) / tile.height;
+  int tile_cols = (now.cols + tile.width - 1) / tile.width;
+  cv::Mat changed = cv::Mat::zeros(tile_rows, tile_cols, CV_8UC1);
+  if (prev.rows != now.rows || prev.cols != now.cols ||
+      prev.type() != now.type()) {
+    changed.setTo(1);
+    return changed;
+  }
+
+  // 疎なグリッドでは1点の増減でもタイルの平均はほとんど変わらないので，
+  // セルごとに判定して数える
+  cv::Mat diff;
+  cv::absdiff(prev, now, diff);
+  vector<cv::Mat> channels;
+  cv::split(diff, channels);
+  cv::Mat max_diff = channels[0];
+  for (int c = 1; c < channels.size(); c++) {
+    cv::max(max_diff, channels[c], max_diff);
+  }
+  cv::Mat cell_changed = max_diff > threshold;
+  if (now.channels() == 1) {
+    cv::Mat appeared = (prev > 0) != (now > 0);
+    cell_changed |= appeared;
+  }
+
+  parallel_for_each<uchar>(
+      changed, [&](uchar& now_tile, const int position[]) -> void {
+        int y = position[0] * tile.height;
+        int x = position[1] * tile.width;
+        cv::Rect rect(x, y, min(tile.width, diff.cols - x),
+                      min(tile.height, diff.rows - y));
+        now_tile = cv::countNonZero(cell_changed(rect)) >= min_cells;
+      });
+  return changed;
+}
+
+void warp_grid(const cv::Mat& grid, const cv::Mat& vs, EnvParams& env_params,
+               const Eigen::Matrix4d& motion, double min_angle_degree,
+               double max_angle_degree, cv::Mat& warped) {
+  LidarModel lidar = LidarModel::uniform("", grid.rows, min_angle_degree,
+                                         max_angle_degree);
+  warp_grid(grid, vs, env_params, motion, lidar, warped);
+}
+
+void warp_grid(const cv::Mat& grid, const cv::Mat& vs, EnvParams& env_params,
+               const Eigen::Matrix4d& motion, const LidarModel& lidar,
+               cv::Mat& warped) {
+  warped = cv::Mat::zeros(grid.rows, grid.cols, CV_64FC1);
+  for (int i = 0; i < grid.rows; i++) {
+    for (int j = 0; j < grid.cols; j++) {
+      double z = grid.at<double>(i, j);
+      if (z <= 0) {
+        continue;
+      }
+
+      // グリッドから点を復元し，現フレームの座標に移す
+      Eigen::Vector4d point(
+          z * (j - env_params.cx) / env_params.fx,
+          z * (vs.at<ushort>(i, j) - env_params.cy) / env_params.fy, z, 1);
+      Eigen::Vector4d moved = motion * point;
+      if (moved[2] <= 0) {
+        continue;
+      }
+
+      double r = sqrt(moved[0] * moved[0] + moved[2] * moved[2]);
+      int v_idx = lidar.layer_of(moved[1], r);
+      int u = round(env_params.cx + env_params.fx * moved[0] / moved[2]);
+      if (u < 0 || u >= grid.cols || v_idx < 0 || v_idx >= grid.rows) {
+        continue;
+      }
+
+      double& now = warped.at<double>(v_idx, u);
+      if (now <= 0 || moved[2] < now) {
+        now = moved[2];
+      }
+    }
+  }
+}
+
+bool update_segment_labels(cv::Mat& img, const cv::Mat& changed, cv::Size tile,
+                           double color_segment_k, double max_ratio,
+                           cv::Mat& labels, int& next_label) {
+  // 変化したタイル
+  vector<cv::Rect> rects;
+  int area = 0;
+  for (int i = 0; i < changed.rows; i++) {
+    for (int j = 0; j < changed.cols; j++) {
+      if (changed.at<uchar>(i, j) == 0) {
+        continue;
+      }
+      cv::Rect rect(j * tile.width, i * tile.height,
+                    min(tile.width, img.cols - j * tile.width),
+                    min(tile.height, img.rows - i * tile.height));
+      rects.push_back(rect);
+      area += rect.area();
+    }
+  }
+  bool same_size = labels.rows == img.rows && labels.cols == img.cols;
+  if (rects.empty() && same_size) {
+    return true;
+  }
+
+  bool partial = !rects.empty() && same_size &&
+                 area <= max_ratio * img.rows * img.cols &&
+                 next_label <= INT_MAX - area;
+  if (!partial) {
+    segment_labels(img, color_segment_k, labels);
+    next_label = img.rows * img.cols;
+    return false;
+  }
+
+  // タイルごとに分割するので，タイルの境界をまたぐ領域は別の領域として扱われる
+  // 変化していないタイルのラベルは変えない
+  for (const cv::Rect& rect : rects) {
+    cv::Mat crop = img(rect).clone();
+    cv::Mat crop_labels;
+    segment_labels(crop, color_segment_k, crop_labels);
+    for (int y = 0; y < rect.height; y++) {
+      for (int x = 0; x < rect.width; x++) {
+        labels.at<int>(rect.y + y, rect.x + x) =
+            next_label + crop_labels.at<int>(y, x);
+      }
+    }
+    next_label += rect.area();
+  }
+  return true;
+}
+
+DirtyTileFilter::DirtyTileFilter(TileMethod method, int halo, TileParams params,
+                                 ImageHook on_image)
+    : method(method),
+      halo(halo),
+      params(params),
+      on_image(on_image),
+      has_prev(false),
+      recomputed(0) {}
+
+void DirtyTileFilter::reset() { has_prev = false; }
+
+int DirtyTileFilter::recomputed_tiles() const { return recomputed; }
+
+void DirtyTileFilter::operator()(cv::Mat& src_grid, cv::Mat& dst_grid,
+                                 cv::Mat& vs, cv::Mat& img) {
+  cv::Size tile = params.tile;
+  cv::Size image_tile(tile.width, params.image_tile_height);
+  int tile_rows = (vs.rows + tile.height - 1) / tile.height;
+  int tile_cols = (vs.cols + tile.width - 1) / tile.width;
+
+  cv::Mat image_changed;
+  cv::Mat dirty;
+  if (has_prev && ref_src_grid.size() == src_grid.size()) {
+    image_changed = changed_tiles(ref_img, img, image_tile,
+                                  params.color_threshold,
+                                  params.min_changed_cells);
+
+    // 点群が変化したタイルと，参照する画像の行が変化したタイル
+    dirty = changed_tiles(ref_src_grid, src_grid, tile,
+                          params.depth_threshold, params.min_changed_cells);
+    parallel_for_each<uchar>(
+        dirty, [&](uchar& now, const int position[]) -> void {
+          if (now) {
+            return;
+          }
+          int y = position[0] * tile.height;
+          int x = position[1] * tile.width;
+          int y_end = min(y + tile.height, vs.rows);
+          int x_end = min(x + tile.width, vs.cols);
+          for (int i = y; i < y_end && !now; i++) {
+            for (int j = x; j < x_end && !now; j++) {
+              int v = vs.at<ushort>(i, j) / image_tile.height;
+              if (v < image_changed.rows &&
+                  image_changed.at<uchar>(v, position[1])) {
+                now = 1;
+              }
+            }
+          }
+        });
+
+    // 変化したセルをhalo内に含むタイルも出力が変わる
+    int dx = (halo + tile.width - 1) / tile.width;
+    int dy = (halo + tile.height - 1) / tile.height;
+    cv::dilate(dirty, dirty, cv::Mat::ones(2 * dy + 1, 2 * dx + 1, CV_8UC1));
+  }
+
+  bool all_dirty = on_image && !on_image(img, image_changed, image_tile);
+
+  if (all_dirty || dirty.empty() ||
+      cv::countNonZero(dirty) > params.max_dirty_ratio * dirty.total()) {
+    method(src_grid, dst_grid, vs, img, cv::Range(0, img.cols));
+    recomputed = tile_rows * tile_cols;
+    ref_src_grid = src_grid.clone();
+    ref_img = img.clone();
+  } else {
+    cv::Mat result = prev_dst_grid.clone();
+    recomputed = 0;
+    for (int i = 0; i < dirty.rows; i++) {
+      for (int j = 0; j < dirty.cols; j++) {
+        if (dirty.at<uchar>(i, j) == 0) {
+          continue;
+        }
+        cv::Rect rect(j * tile.width, i * tile.height,
+                      min(tile.width, vs.cols - j * tile.width),
+                      min(tile.height, vs.rows - i * tile.height));
+        cv::Rect outer(rect.x - halo, rect.y - halo, rect.width + 2 * halo,
+                       rect.height + 2 * halo);
+        outer = outer & cv::Rect(0, 0, vs.cols, vs.rows);
+
+        cv::Mat src_crop = src_grid(outer).clone();
+        cv::Mat vs_crop = vs(outer).clone();
+        cv::Mat dst_crop;
+        method(src_crop, dst_crop, vs_crop, img,
+               cv::Range(outer.x, outer.x + outer.width));
+
+        cv::Rect inner(rect.x - outer.x, rect.y - outer.y, rect.width,
+                       rect.height);
+        cv::Mat target = result(rect);
+        dst_crop(inner).copyTo(target);
+        cv::Mat ref_target = ref_src_grid(rect);
+        src_grid(rect).copyTo(ref_target);
+        recomputed++;
+      }
+    }
+    dst_grid = result;
+
+    // 変化した画像のタイルを参照するタイルは全て計算し直したので，基準を更新する
+    // 変化しなかったタイルは基準を残し，少しずつの変化も積算して検出する
+    for (int i = 0; i < image_changed.rows; i++) {
+      for (int j = 0; j < image_changed.cols; j++) {
+        if (image_changed.at<uchar>(i, j) == 0) {
+          continue;
+        }
+        cv::Rect rect(j * image_tile.width, i * image_tile.height,
+                      min(image_tile.width, img.cols - j * image_tile.width),
+                      min(image_tile.height,
+                          img.rows - i * image_tile.height));
+        cv::Mat ref_target = ref_img(rect);
+        img(rect).copyTo(ref_target);
+      }
+    }
+  }
+
+  has_prev = true;
+  prev_dst_grid = dst_grid.clone();
+}
+
+shared_ptr<DirtyTileFilter> pwas_tile_filter(double sigma_c, double sigma_s,
+                                             double sigma_r, double r,
+                                             TileParams params) {
+  // 信頼度は隣接する点の色を参照するので1つ広げる
+  return make_shared<DirtyTileFilter>(
+      [=](cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs, cv::Mat& img,
+          cv::Range cols) {
+        cv::Mat img_crop = img(cv::Range::all(), cols).clone();
+        pwas(src_grid, dst_grid, vs, img_crop, sigma_c, sigma_s, sigma_r, r);
+      },
+      (int)r / 2 + 1, params);
+}
+
+shared_ptr<DirtyTileFilter> guided_filter_tile_filter(EnvParams env_params,
+                                                      TileParams params) {
+  // 平均を2回取るので窓の大きさ(11)分広げる
+  return make_shared<DirtyTileFilter>(
+      [=](cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs, cv::Mat& img,
+          cv::Range cols) {
+        cv::Mat img_crop = img(cv::Range::all(), cols).clone();
+        guided_filter(src_grid, dst_grid, vs, env_params, img_crop);
+      },
+      11, params);
+}
+
+shared_ptr<DirtyTileFilter> original_tile_filter(double color_segment_k,
+                                                 double sigma_s, int r,
+                                                 double coef_s,
+                                                 TileParams params) {
+  struct Segments {
+    cv::Mat labels;
+    int next_label = 0;
+  };
+  shared_ptr<Segments> segments = make_shared<Segments>();
+
+  return make_shared<DirtyTileFilter>(
+      [=](cv::Mat& src_grid, cv::Mat& dst_grid, cv::Mat& vs, cv::Mat& img,
+          cv::Range cols) {
+        NeighborIndex neighbors;
+        build_neighbor_index(src_grid, ext_jbu_window(r), neighbors);
+        ext_jbu(src_grid, dst_grid, vs,
+                segments->labels(cv::Range::all(), cols), sigma_s, neighbors,
+                coef_s);
+      },
+      r / 2, params,
+      [=](cv::Mat& img, const cv::Mat& changed, cv::Size image_tile) {
+        if (changed.empty()) {
+          segment_labels(img, color_segment_k, segments->labels);
+          segments->next_label = img.rows * img.cols;
+          return false;
+        }
+        // 画像全体を分割し直した場合は全てのタイルのラベルが変わる
+        return update_segment_labels(img, changed, image_tile,
+                                     color_segment_k, params.max_segment_ratio,
+                                     segments->labels, segments->next_label);
+      });
+}
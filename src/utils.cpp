@@ -3,6 +3,8 @@
 
 #include <opencv2/opencv.hpp>
 
+#include "color_distance.h"
+#include "parallel.h"
 #include "utils.h"
 
 using namespace std;
@@ -31,12 +33,7 @@ bool UnionFind::same(int x, int y) { return root(x) == root(y); }
 int UnionFind::size(int x) { return -d[root(x)]; }
 
 double SegmentationGraph::get_diff(cv::Vec3b& a, cv::Vec3b& b) {
-  double diff = 0;
-  for (int i = 0; i < 3; i++) {
-    diff += (a[i] - b[i]) * (a[i] - b[i]);
-  }
-  diff = sqrt(diff);
-  return diff;
+  return sqrt((double)color_ssd(a, b));
 }
 
 double SegmentationGraph::get_threshold(double k, int size) {
@@ -47,19 +44,40 @@ SegmentationGraph::SegmentationGraph(cv::Mat* img) {
   length = img->rows * img->cols;
   int dx[] = {1, 0, 0, -1};
   int dy[] = {0, 1, -1, 0};
+  auto valid = [&](int to_x, int to_y) {
+    return 0 <= to_x && to_x < img->cols && 0 <= to_y && to_y < img->rows;
+  };
+
+  // 行ごとの辺の数から書き込み位置を決め，直列の場合と同じ順序で並列に構築する
+  vector<int> offsets(img->rows + 1, 0);
   for (int i = 0; i < img->rows; i++) {
-    cv::Vec3b* row = img->ptr<cv::Vec3b>(i);
+    int cnt = 0;
     for (int j = 0; j < img->cols; j++) {
       for (int k = 0; k < 2; k++) {
-        int to_x = j + dx[k];
-        int to_y = i + dy[k];
-        if (0 <= to_x && to_x < img->cols && 0 <= to_y && to_y < img->rows) {
-          double diff = get_diff(row[j], img->at<cv::Vec3b>(to_y, to_x));
-          edges.emplace_back(diff, i * img->cols + j, to_y * img->cols + to_x);
-        }
+        cnt += valid(j + dx[k], i + dy[k]);
       }
     }
+    offsets[i + 1] = offsets[i] + cnt;
   }
+
+  edges.resize(offsets.back());
+  parallel_for(0, img->rows, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      cv::Vec3b* row = img->ptr<cv::Vec3b>(i);
+      int n = offsets[i];
+      for (int j = 0; j < img->cols; j++) {
+        for (int k = 0; k < 2; k++) {
+          int to_x = j + dx[k];
+          int to_y = i + dy[k];
+          if (valid(to_x, to_y)) {
+            double diff = get_diff(row[j], img->at<cv::Vec3b>(to_y, to_x));
+            edges[n++] = make_tuple(diff, i * img->cols + j,
+                                    to_y * img->cols + to_x);
+          }
+        }
+      }
+    }
+  });
 }
 
 shared_ptr<UnionFind> SegmentationGraph::segmentate(double k) {